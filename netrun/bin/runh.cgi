@@ -881,13 +881,13 @@ END_ACE
 	print
 		"<p>Compile options:",
 		$q->checkbox_group(-name=>'ocompile',
-			-values=>['TraceASM','Optimize','Debug','Warnings','Verbose'],
+			-values=>['TraceASM','FastTrace','Optimize','Debug','Warnings','Verbose'],
 			-defaults=>['Optimize','Warnings']),"<br>\n";
 
 	print
 		"<p>Actions:",
 		$q->checkbox_group(-name=>'orun',
-			-values=>['Run','Disassemble','Grade','Time','Profile'],
+			-values=>['Run','Disassemble','Grade','Time','Counters','Profile'],
 			-defaults=>['Run','Grade']),"\n";
 
 	print '<p>Link with: ',
@@ -944,6 +944,7 @@ sub compile_and_run {
 	my_start_redir('log'); 
 	system("$config::run_dir/bin/sandsend",
 		"-f","$userdir/project.tar",
+		"-d","$userdir/project",
 		"-u","$user",
 		"$proj->{sr_host}:$proj->{sr_port}") 
 		and print("<h2>ERROR!</h2> Cannot send off project (machine may be down)\n<br>");
@@ -1072,6 +1073,9 @@ sub create_project_directory {
 	
 	my @ocompile=$q->param('ocompile');
 	my @orun=$q->param('orun');
+	if (grep(/^FastTrace$/, @ocompile)==1 and grep(/^TraceASM$/, @ocompile)!=1) {
+		push(@ocompile,"TraceASM"); # FastTrace is a buffered TraceASM
+	}
 	#if (!@orun) { @orun=("Disassemble", "Run"); }		
 # Done checking-- log and run the thing
 	my $short_code;  # Syslog chokes on huge logs
@@ -1130,16 +1134,20 @@ sub create_project_directory {
 	if (grep(/^Debug$/, @ocompile)==1) {push(@cflags,"-g");}
 	if (grep(/^Warnings$/, @ocompile)==1) {push(@cflags,"-Wall");}
 	if (grep(/^Shared$/, @ocompile)==1) {push(@cflags,"-fPIC");}
+	if (grep(/^FastTrace$/, @ocompile)==1) {push(@lflags,"-DTRACEASM_BUFFER=1");}
 	
 	if (grep(/^Run$/, @orun)==1) {$netrun="$netrun netrun/run";}
 	if (grep(/^Grade$/, @orun)==1) {$netrun="$netrun netrun/grade";}
-	if (grep(/^Time$/, @orun)==1) {
+	if (grep(/^Time$/, @orun)==1 or grep(/^Counters$/, @orun)==1) {
 		if ($mode eq 'main') {
 			print "Sorry, cannot time a Whole Program; ";
 			print "for the Time checkbox to work, you need to run inside a function, or write a foo function. <br>\n";
 		}
 		else {
 			push(@lflags,"-DTIME_FOO=1");
+			if (grep(/^Counters$/, @orun)==1) { # hardware counters too
+				push(@lflags,"-DTIME_COUNTERS=1");
+			}
 			$main="include/lib/main.cpp";
 		}
 	}
@@ -0,0 +1,34 @@
+#!/bin/sh
+#  Build the read-only jail template s4g_chroot runs programs inside,
+#  /usr/local/bin/s4g_jail, out of the libraries in /usr/local/bin/s4g_libs
+#  (see copy_libs.sh).  Run as root, and again whenever the libraries change.
+src="/usr/local/bin/s4g_libs"
+d="/usr/local/bin/s4g_jail"
+
+rm -fr "$d.new"
+mkdir "$d.new" || exit 1
+cd "$d.new" || exit 1
+mkdir lib lib64 etc proc dev tmp run
+
+# Libraries, including the 64-bit dynamic linker
+cp -p "$src"/* lib/
+[ -r "$src/ld-linux-x86-64.so.2" ] && cp -p "$src/ld-linux-x86-64.so.2" lib64/
+
+# The few system files programs look at (s4g_chroot fills in dev/urandom)
+cp /etc/resolv.conf /etc/nsswitch.conf /etc/services /etc/hosts /etc/host.conf etc/  > /dev/null 2>&1
+if [ -r /proc/stat ]
+then
+	cp /proc/stat proc/stat
+else
+	printf "cpu\ncpu0\ncpu1\n" > proc/stat
+fi
+
+chown -R root:root .
+chmod -R go-w,a+rX .
+
+# Swap the new template into place
+cd /
+rm -fr "$d.old"
+[ -d "$d" ] && mv "$d" "$d.old"
+mv "$d.new" "$d" && rm -fr "$d.old"
+echo "Built jail template in $d"
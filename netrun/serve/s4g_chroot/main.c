@@ -5,6 +5,22 @@ Run a program inside an "chroot" jail as an unprivileged user:
 	- Fork off a child, drop privileges, and exec program
 	- Kill program if it runs too long
 
+On Linux, if the prebuilt jail template jailSrc exists (see 
+build_jail.sh), we don't hardlink anything but the program: instead
+we mount the template read-only in our own private mount namespace, 
+mount the run directory at its /run, put a fresh tmpfs on /dev 
+and /tmp, and chroot into the template.  That's a few system calls,
+not a shell and a pile of links and copies every run.
+
+If $S4G_REPORT names a file, we append one line of key=value 
+accounting for the run: exit status, signal, whether it timed out,
+wall and CPU time, max RSS, page faults, and context switches of the
+program and everything it started, plus cgroup v2 totals if we could
+give the run its own cgroup.
+
+"s4g_chroot -d" runs a fork server that does the jail setup 
+for later runs (see "Fork server" below).
+
 The permissions in the run directory should not allow setuid
 executables, direct hardware devices, etc.
 
@@ -13,6 +29,9 @@ as required by chroot.
 
 Orion Sky Lawlor, olawlor@acm.org 2006/09/22 (Public Domain)
 */
+#ifdef __linux__
+#define _GNU_SOURCE /* for unshare */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h> /* for signal */
@@ -20,17 +39,53 @@ Orion Sky Lawlor, olawlor@acm.org 2006/09/22 (Public Domain)
 #include <sys/stat.h> /* for mkdir */
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <dirent.h> /* for readdir */
+#include <string.h>
+#include <errno.h>
+#include <sys/resource.h> /* for getrusage */
+#include <sys/file.h> /* for flock */
+#ifdef __linux__
+#include <sys/prctl.h> /* for PR_SET_CHILD_SUBREAPER */
+#include <sched.h> /* for unshare */
+#include <sys/mount.h>
+#include <sys/vfs.h> /* for statfs */
+#include <linux/magic.h> /* for CGROUP2_SUPER_MAGIC */
+#include <sys/random.h> /* for getrandom */
+#include <poll.h> /* for ppoll */
+#endif
 #ifdef SOLARIS /* needed with at least Solaris 8 */
 #include <siginfo.h>
 #endif
 
 /* Configuration defines.  Override these from the Makefile */
 #ifndef runUser
-#  define runUser 6661313 /* *unprivileged* user ID to run as */
+#  define runUser 6661313 /* first *unprivileged* user ID to run as */
+#endif
+#ifndef runUsers
+#  define runUsers 32 /* concurrent runs get user IDs runUser..runUser+runUsers-1 */
+#endif
+#ifndef userLockDir
+#  define userLockDir "/run/s4g_chroot" /* lock files for who's using each user ID */
 #endif
 #ifndef runTime
 #  define runTime 2 /* seconds to allow program to run before killing it */
 #endif
+#ifndef runMem
+#  define runMem (100*1024*1024) /* bytes of RAM, with a cgroup (else just brk) */
+#endif
+#ifndef runProcs
+#  define runProcs 9 /* processes and threads (per run with a cgroup, else per user ID) */
+#endif
+#ifndef benchWait
+#  define benchWait 10 /* seconds a benchmark run waits for a reserved CPU, before running unpinned */
+#endif
+#ifndef runCPUs
+#  define runCPUs 0 /* cores' worth of CPU time, with a cgroup (0: no limit, so threads all get cores) */
+#endif
+#ifndef s4gPath
+#  define s4gPath "/usr/local/bin/s4g_chroot" /* the setuid one, for s4g_run to fall back on */
+#endif
 #define runDir "run" /* new directory to run code inside */
 #define exeName "code.exe" /* executable's new name in run directory */
 
@@ -47,42 +102,243 @@ Orion Sky Lawlor, olawlor@acm.org 2006/09/22 (Public Domain)
 #  define libDir "lib" /* library directory name in the run directory */
 #endif
 
+/* Read-only jail template, with lib, etc, proc/stat, and empty 
+ run, dev, and tmp directories.  Built by build_jail.sh. */
+#ifndef jailSrc
+#  define jailSrc "/usr/local/bin/s4g_jail"
+#endif
+
+/* Where cgroup v2 is mounted.  Each run gets its own cgroup inside
+ cgroupDir, for accounting.  Runs work without it, just with less. */
+#ifndef cgroupRoot
+#  define cgroupRoot "/sys/fs/cgroup"
+#endif
+#define cgroupDir cgroupRoot "/s4g_chroot"
+
+/* Accounting for the run, written as one line of key=value pairs
+ to the file named by $S4G_REPORT (opened as the calling user). */
+int reportFD=-1;
+int childStatus=-1; /* child's wait status, once we have it */
+int timedOut=0; /* 1 if we killed it for running too long */
+struct timeval startTime; /* when the child was forked */
+int cgParentFD=-1, cgFD=-1, cgProcsFD=-1; /* cgroupDir, ours, and our cgroup.procs */
+char cgName[64]; /* name of our cgroup in cgroupDir */
+int cgMemory=0, cgPids=0; /* 1 if our cgroup limits memory, processes */
+char cpuSet[64]; /* CPUs to run on, like "2-3", from $S4G_CPUS (or empty) */
+char benchCPUs[64]; /* reserved CPUs for benchmark runs, if this is one */
+int benchCPU=-1; /* reserved CPU this benchmark run got (-2: gave up waiting) */
+
+/* Write this value to this file in our cgroup.  Returns 1 if it took. */
+int cgroup_write(const char *name,const char *value) {
+	int fd, ok;
+	if (cgFD<0) return 0;
+	fd=openat(cgFD,name,O_WRONLY|O_CLOEXEC);
+	if (fd<0) return 0;
+	ok=(write(fd,value,strlen(value))==(int)strlen(value));
+	close(fd);
+	return ok;
+}
+
+/* Read this small file in our cgroup, or return 0 if we can't */
+char *cgroup_read(const char *name,char *buf,int len) {
+	int fd=openat(cgFD,name,O_RDONLY|O_CLOEXEC), n;
+	if (fd<0) return 0;
+	n=read(fd,buf,len-1);
+	close(fd);
+	if (n<=0) return 0;
+	buf[n]=0;
+	return buf;
+}
+
+/* Return the number after this key in a cgroup "key value" file */
+long cgroup_key(const char *text,const char *key) {
+	const char *at=text;
+	int len=strlen(key);
+	while ((at=strstr(at,key))!=NULL) {
+		if ((at==text || at[-1]=='\n') && at[len]==' ') return atol(at+len+1);
+		at+=len;
+	}
+	return -1;
+}
+
+/* Add our cgroup's statistics to this report line, and remove it. */
+void cgroup_report(char *line,int len) {
+	char buf[4096];
+	int n=strlen(line);
+	if (cgFD<0) return;
+	if (cgroup_read("cpu.stat",buf,sizeof(buf)))
+		n+=snprintf(line+n,len-n," cg_user_us=%ld cg_sys_us=%ld",
+			cgroup_key(buf,"user_usec"),cgroup_key(buf,"system_usec"));
+	if (n<len && cgroup_read("memory.peak",buf,sizeof(buf)))
+		n+=snprintf(line+n,len-n," cg_mem_peak_kb=%ld",atol(buf)/1024);
+	if (n<len && cgroup_read("memory.events",buf,sizeof(buf)))
+		n+=snprintf(line+n,len-n," cg_oom_kill=%ld",cgroup_key(buf,"oom_kill"));
+	if (n<len && cgroup_read("pids.peak",buf,sizeof(buf)))
+		n+=snprintf(line+n,len-n," cg_pids_peak=%ld",atol(buf));
+	close(cgFD); cgFD=-1;
+	unlinkat(cgParentFD,cgName,AT_REMOVEDIR);
+}
+
+/* Write the accounting line for this run (everything's been waited for) */
+void report(void) {
+	char line[1024];
+	struct rusage ru;
+	struct timeval now;
+	long wall;
+	int n;
+	gettimeofday(&now,NULL);
+	getrusage(RUSAGE_CHILDREN,&ru); /* everything we (and they) waited for */
+	wall=(now.tv_sec-startTime.tv_sec)*1000000L+(now.tv_usec-startTime.tv_usec);
+	snprintf(line,sizeof(line),
+		"exit=%d signal=%d timeout=%d wall_us=%ld user_us=%ld sys_us=%ld "
+		"maxrss_kb=%ld minflt=%ld majflt=%ld nvcsw=%ld nivcsw=%ld",
+		(childStatus!=-1 && WIFEXITED(childStatus))?WEXITSTATUS(childStatus):-1,
+		(childStatus!=-1 && WIFSIGNALED(childStatus))?WTERMSIG(childStatus):
+			(childStatus==-1 && timedOut)?SIGKILL:0, /* (we killed it; its status got away) */
+		timedOut, wall,
+		ru.ru_utime.tv_sec*1000000L+ru.ru_utime.tv_usec,
+		ru.ru_stime.tv_sec*1000000L+ru.ru_stime.tv_usec,
+		ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt, ru.ru_nvcsw, ru.ru_nivcsw);
+	if (benchCPU>=0) {
+		n=strlen(line);
+		snprintf(line+n,sizeof(line)-n," cpu=%d",benchCPU);
+	}
+	if (benchCPU==-2) { /* timings from this run aren't steady */
+		n=strlen(line);
+		snprintf(line+n,sizeof(line)-n," cpu=none");
+	}
+	cgroup_report(line,sizeof(line)-1);
+	n=strlen(line);
+	line[n++]='\n';
+	if (reportFD>=0) write(reportFD,line,n);
+}
+
+int jobUser=runUser; /* user ID this run's program runs as */
+int userLockFD=-1; /* locked while we're using jobUser */
+
+/* Kill every process running as this user.  Only safe because
+  each run has its own user ID.  WARNING: This routine runs as root! */
+void kill_user(int uid) {
+	int pid=fork(), status;
+	if (pid==0) {
+		setuid(uid);
+		kill(-1,SIGKILL); /* (everything we can, which is everything as uid) */
+		_exit(0);
+	}
+	if (pid>0) while (waitpid(pid,&status,0)<0 && errno==EINTR) {}
+}
+
+/* Claim a user ID from the pool that no other run is using, and hold
+  it (with an flock, which goes away even if we crash) until we exit.
+  If they're all in use, wait for one.  We start looking at a slot 
+  picked by the run directory (our current directory), so runs one
+  after another in the same directory (like run, then grade) get the
+  same user, and can overwrite each other's files.
+  WARNING: This routine runs as root! */
+void pick_user(void) {
+	char name[100];
+	struct stat st;
+	int i, start=0;
+	if (0==stat(".",&st)) start=st.st_ino%runUsers;
+	mkdir(userLockDir,0700);
+	for (i=0;i<=runUsers;i++) {
+		int slot=(start+i)%runUsers;
+		int fd;
+		snprintf(name,sizeof(name),userLockDir "/uid%d",runUser+slot);
+		fd=open(name,O_RDWR|O_CREAT|O_CLOEXEC,0600);
+		if (fd<0) continue;
+		/* Last try: all busy, so wait our turn */
+		if (0==flock(fd,(i==runUsers)?LOCK_EX:(LOCK_EX|LOCK_NB))) {
+			jobUser=runUser+slot;
+			userLockFD=fd;
+			/* Anything still running as our user is left over from a crashed run. */
+			kill_user(jobUser);
+			break;
+		}
+		close(fd);
+	}
+	/* If we couldn't lock anything, we share runUser, like before,
+	  and leave alone whatever else is running as it. */
+}
+
 int childPID=0;
+
+/* Fork server handler: the client's socket, which gets runDone once
+  the run is over, and whose hangup means we should stop the run. */
+int clientFD=-1;
+#define runDone "s4g_status ok"
+
+#ifdef __linux__
+void wake_up(int cause) {}
+
+/* Wait for the child like waitpid, but give up and return 0 if the 
+  client hangs up first (like when it's killed for running too long). */
+int wait_child(int *status) {
+	sigset_t chld, old;
+	struct pollfd p;
+	int r;
+	if (clientFD<0) return waitpid(childPID,status,0);
+	sigemptyset(&chld);
+	sigaddset(&chld,SIGCHLD);
+	sigprocmask(SIG_BLOCK,&chld,&old); /* so it can only arrive inside ppoll */
+	signal(SIGCHLD,wake_up);
+	while (0==(r=waitpid(childPID,status,WNOHANG))) {
+		p.fd=clientFD; p.events=POLLRDHUP; p.revents=0;
+		if (ppoll(&p,1,NULL,&old)>0 && (p.revents&(POLLRDHUP|POLLHUP|POLLERR)))
+			break; /* nobody's waiting for this run any more */
+	}
+	sigprocmask(SIG_SETMASK,&old,NULL);
+	return r;
+}
+#else
+int wait_child(int *status) {return waitpid(childPID,status,0);}
+#endif
+
 /** Call wait() to allow the child process to finish.
   If termFirst is true, make the child finish immediately.
   Otherwise just wait nicely for the child.
   WARNING: This routine runs as root! 
 */
 void waitForChild(int termFirst) {
+	int status=0, pid;
 	if (childPID==0) exit(0); /* child not yet created! */
 	//printf("Killing process %d\n",childPID);
 	if (termFirst) goto terminate;
 	while (kill(childPID,0)==0) 
 	{ /* child process is still there-- wait on it */
-		int status=0;
-		wait(&status);
+		if (wait_child(&status)==childPID) childStatus=status;
 	terminate: 
 		/* try killing the child's entire process group */
 		kill(-childPID,SIGKILL);
 		/* And also try killing just the child */
 		kill(childPID,SIGKILL);
 	}
-	if (1) {
-	/* As a backup, kill everything in the nobody account.
-	   This isn't foolproof, and is probably not needed. */
-		setuid(runUser);
-		kill(-1,SIGKILL);
+	signal(SIGALRM,SIG_IGN); /* it's over */
+	/* Kill anything the program left running: everything in its 
+	   cgroup, which nothing it started can leave. */
+	if (!cgroup_write("cgroup.kill","1") && userLockFD>=0) {
+	/* As a backup, kill everything running as our user (if it's ours
+	   alone: the shared runUser may have other runs' programs). */
+		kill_user(jobUser);
 	}
+	/* Wait for that, and anything the program left behind 
+	   (we're their subreaper), so they're in the accounting. */
+	while ((pid=wait(&status))>0 || errno==EINTR)
+		if (pid==childPID && childStatus==-1) childStatus=status;
+	report();
+	if (clientFD>=0) write(clientFD,runDone,strlen(runDone));
 	exit(0);
 }
 
 void signalHandler(int cause) {
 	printf("Killing program--ran too long!\n");
+	timedOut=1;
 	waitForChild(1);
 }
 void bad(int err,const char *fn) {
 	perror("Error");
 	printf("Error %d returned during execution of syscall '%s'\n",err,fn);
+	if (childPID==0) exit(1); /* nothing ran (or we're the child): say so */
 	waitForChild(1);
 }
 
@@ -90,7 +346,6 @@ void bad(int err,const char *fn) {
 	{ int err=fn args; if (err!=0) {bad(err,#fn);}}
 #define nocheck(fn,args) fn args
 
-#include <sys/resource.h> /* FIXME: is this linux-specific? */
 void my_limit(int resource,int val) {
 	struct rlimit r; 
 	r.rlim_cur=val;
@@ -99,30 +354,216 @@ void my_limit(int resource,int val) {
 }
 
 
-int main(int argc,char *argv[]){ 
-	struct itimerval itimer;
+/* Hardlink everything in libSrc into libDir (in the current directory). */
+void link_libs(void) {
+	char src[1024], dest[1024];
+	struct dirent *e;
+	DIR *d=opendir(libSrc);
+	if (d==NULL) return;
+	while ((e=readdir(d))!=NULL) {
+		if (e->d_name[0]=='.') continue;
+		snprintf(src,sizeof(src),"%s/%s",libSrc,e->d_name);
+		snprintf(dest,sizeof(dest),"%s/%s",libDir,e->d_name);
+		unlink(dest); /* like ln -f */
+		link(src,dest);
+	}
+	closedir(d);
+}
+
+#ifdef __linux__
+/* Move into our own private mount namespace, and mount the jail 
+  template read-only there.  Returns 0 if there's no template, or 
+  we can't have our own mounts (like without cap_sys_admin), so
+  the caller can build the jail the old way.  
+  WARNING: This routine runs as root! */
+int mount_template(void) {
+	struct stat st;
+	if (0!=stat(jailSrc "/" runDir,&st)) return 0; /* no template */
+	if (0!=unshare(CLONE_NEWNS)) return 0;
 	
-/* Paranoia */
-	seteuid(getuid()); /* give up setuid privileges before doing anything else http://yarchive.net/comp/setuid_mess.html */
-	unsetenv("IFS"); /* used by shell */
-	unsetenv("PATH");
-	unsetenv("LD_LIBRARY_PATH");
-	/*clearenv();*/
+	/* Don't let any of these mounts leak out to the real system */
+	if (0!=mount("none","/",NULL,MS_REC|MS_PRIVATE,NULL) ||
+	    0!=mount(jailSrc,jailSrc,NULL,MS_BIND|MS_REC,NULL) ||
+	    0!=mount(NULL,jailSrc,NULL,MS_BIND|MS_REMOUNT|MS_RDONLY|MS_NOSUID|MS_NODEV,NULL))
+	{
+		perror("s4g_chroot: can't mount jail template");
+		return 0;
+	}
+	return 1;
+}
 
-/* Parse command line */
-	if (argc<=1) {
-		printf("Usage: s4g_chroot <exe> <args>\n"
-			"   Runs this executable in a little chroot jail built in the '" runDir "' directory.\n");
-		return 1;
+/* Mount the run directory (our current directory) at the template's 
+  /run, and fresh /tmp and /dev.  Returns 0 if any of that failed.
+  WARNING: This routine runs as root! */
+int mount_run(void) {
+	char rnd[4096];
+	int fd, n=0;
+	if (0!=mount(".",jailSrc "/" runDir,NULL,MS_BIND,NULL) ||
+	    0!=mount(NULL,jailSrc "/" runDir,NULL,MS_BIND|MS_REMOUNT|MS_NOSUID|MS_NODEV,NULL) ||
+	    0!=mount("tmpfs",jailSrc "/tmp","tmpfs",MS_NOSUID|MS_NODEV,"size=16m,mode=1777") ||
+	    0!=mount("tmpfs",jailSrc "/dev","tmpfs",MS_NOSUID|MS_NODEV|MS_NOEXEC,"size=64k,mode=755"))
+	{
+		perror("s4g_chroot: can't mount run directory in jail");
+		return 0;
 	}
 	
-/* Create rundir */
-	//check(system,("/bin/rm -fr "runDir)); /* (leftover stuff could be sensitive or dangerous) */
-	nocheck(mkdir,(runDir,0777)); /* 777 since program needs to be able to create files... */
-	nocheck(chmod,(runDir,0777)); /* override umask */
-	nocheck(link,(argv[1],runDir "/" exeName)); /* hardlink over executable */
-	check(chdir,(runDir)); /* everything else happens inside the run directory */
+	/* No device files: /dev/urandom is just some fresh random bytes */
+	while (n<(int)sizeof(rnd)) {
+		int r=getrandom(rnd+n,sizeof(rnd)-n,0);
+		if (r<=0) return 0;
+		n+=r;
+	}
+	fd=open(jailSrc "/dev/urandom",O_WRONLY|O_CREAT|O_TRUNC,0444);
+	if (fd<0) return 0;
+	if (write(fd,rnd,sizeof(rnd))!=(int)sizeof(rnd)) { close(fd); return 0; }
+	close(fd);
+	return 1;
+}
+#else
+int mount_template(void) {return 0;}
+int mount_run(void) {return 0;}
+#endif
+
+/* Copy this CPU list (like "0,2-3") into dest, if it looks like one */
+void set_cpus(char *dest,const char *list) {
+	if (strlen(list)>=sizeof(cpuSet) || strspn(list,"0123456789,-")!=strlen(list))
+		return; /* not a CPU list */
+	strcpy(dest,list);
+}
+
+#ifdef __linux__
+/* Parse a CPU list like "0,2-3" into this set.  Returns the number of CPUs. */
+int parse_cpus(const char *list,cpu_set_t *set) {
+	int n=0;
+	CPU_ZERO(set);
+	while (*list) {
+		char *end;
+		long lo=strtol(list,&end,10), hi=lo;
+		if (end==list) break;
+		if (*end=='-') hi=strtol(end+1,&end,10);
+		for (;lo<=hi && lo<CPU_SETSIZE;lo++) { CPU_SET(lo,set); n++; }
+		list=end;
+		if (*list==',') list++; else break;
+	}
+	return n;
+}
+
+/* Benchmark run: claim one of the reserved benchCPUs all to ourselves 
+  (with an flock, like pick_user), waiting for whichever frees up first
+  if they're all in use, and run on just that CPU.  After benchWait 
+  seconds, give up and run unpinned.  WARNING: This routine runs as root! */
+void pick_cpu(void) {
+	char name[100];
+	cpu_set_t set;
+	int c, fds[CPU_SETSIZE];
+	long waited=0, wait=1000; /* microseconds */
+	if (parse_cpus(benchCPUs,&set)==0) return;
+	mkdir(userLockDir,0700);
+	for (c=0;c<CPU_SETSIZE;c++) {
+		fds[c]=-1;
+		if (!CPU_ISSET(c,&set)) continue;
+		snprintf(name,sizeof(name),userLockDir "/cpu%d",c);
+		fds[c]=open(name,O_RDWR|O_CREAT|O_CLOEXEC,0600);
+	}
+	while (benchCPU<0) {
+		for (c=0;c<CPU_SETSIZE && benchCPU<0;c++)
+			if (fds[c]>=0 && 0==flock(fds[c],LOCK_EX|LOCK_NB)) {
+				benchCPU=c; /* (fd stays open, and locked, until we exit) */
+				snprintf(cpuSet,sizeof(cpuSet),"%d",c);
+			}
+		if (benchCPU>=0) break;
+		if (waited>=benchWait*1000000L) { benchCPU=-2; break; }
+		usleep(wait);
+		waited+=wait;
+		if (wait<50000) wait*=2; /* back off, up to 50ms */
+	}
+	for (c=0;c<CPU_SETSIZE;c++)
+		if (fds[c]>=0 && c!=benchCPU) close(fds[c]);
+}
+
+/* Run the calling process on just the cpuSet CPUs, if any */
+void pin_cpus(void) {
+	cpu_set_t set;
+	if (cpuSet[0] && parse_cpus(cpuSet,&set)>0)
+		sched_setaffinity(0,sizeof(set),&set);
+}
+#else
+void pick_cpu(void) {}
+void pin_cpus(void) {}
+#endif
 
+/* Make a cgroup v2 leaf for this run, so we can limit and account 
+  for everything it does.  Skips it, or any limits the kernel doesn't 
+  support, if cgroups aren't available.  WARNING: This routine runs as root! */
+void make_cgroup(void) {
+#ifdef __linux__
+	static const char *controllers[]={"+cpu","+cpuset","+memory","+pids"};
+	char v[64];
+	int i, fd;
+	struct statfs fs;
+	if (cgFD>=0) return; /* already made, by a fork server handler */
+	if (0!=statfs(cgroupRoot,&fs) || fs.f_type!=CGROUP2_SUPER_MAGIC) return;
+	mkdir(cgroupDir,0755);
+	cgParentFD=open(cgroupDir,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (cgParentFD<0) return;
+	fd=openat(cgParentFD,"cgroup.subtree_control",O_WRONLY|O_CLOEXEC);
+	for (i=0;fd>=0 && i<4;i++) /* one at a time: any might be missing */
+		write(fd,controllers[i],strlen(controllers[i]));
+	if (fd>=0) close(fd);
+	snprintf(cgName,sizeof(cgName),"run%d",(int)getpid());
+	if (0!=mkdirat(cgParentFD,cgName,0755)) return;
+	cgFD=openat(cgParentFD,cgName,O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (cgFD<0) return;
+	cgProcsFD=openat(cgFD,"cgroup.procs",O_WRONLY|O_CLOEXEC);
+	
+	snprintf(v,sizeof(v),"%ld",(long)runMem);
+	cgMemory=cgroup_write("memory.max",v);
+	cgroup_write("memory.swap.max","0");
+	snprintf(v,sizeof(v),"%d",runProcs);
+	cgPids=cgroup_write("pids.max",v);
+	if (runCPUs>0) {
+		snprintf(v,sizeof(v),"%d 100000",runCPUs*100000); /* microseconds per 100ms */
+		cgroup_write("cpu.max",v);
+	}
+#endif
+}
+
+/* Copy up to max bytes of the file src to dest; return 0 on failure. */
+int copy_file(const char *src,const char *dest,int max) {
+	char buf[4096];
+	int in, out, n=0, r;
+	if (0>(in=open(src,O_RDONLY))) return 0;
+	if (0>(out=open(dest,O_WRONLY|O_CREAT|O_TRUNC,0644))) { close(in); return 0; }
+	while (n<max && 0<(r=read(in,buf,(max-n<(int)sizeof(buf))?max-n:(int)sizeof(buf)))) {
+		if (write(out,buf,r)!=r) break;
+		n+=r;
+	}
+	close(in); close(out);
+	return n>0;
+}
+
+/* Without a jail template, build the jail in the run directory
+  (our current directory) by linking in the libraries. */
+void link_jail(void) {
+	static const char *etcFiles[]={"resolv.conf","nsswitch.conf","services","hosts","host.conf",NULL};
+	char src[100], dest[100];
+	int i;
+	
+/* The few system files programs expect to read, same as a template has */
+	nocheck(mkdir,("proc",0755));
+	if (!copy_file("/proc/stat","proc/stat",1024*1024)) {
+		FILE *f=fopen("proc/stat","w");
+		if (f) { fprintf(f,"cpu\ncpu0\ncpu1\n"); fclose(f); }
+	}
+	nocheck(mkdir,("etc",0755));
+	for (i=0;etcFiles[i];i++) {
+		sprintf(src,"/etc/%s",etcFiles[i]);
+		sprintf(dest,"etc/%s",etcFiles[i]);
+		copy_file(src,dest,1024*1024);
+	}
+	nocheck(mkdir,("dev",0755));
+	copy_file("/dev/urandom","dev/urandom",4096);
+	
 #if defined(__linux__) && defined(__LP64__)
 /* Linux 64-bit executables need /lib64/ld-linux-x86-64.so.2 */
 	nocheck(mkdir,("lib64",0777));
@@ -136,11 +577,23 @@ int main(int argc,char *argv[]){
 	nocheck(system,("cp /usr/libexec/ld.elf_so usr/libexec"));
 #endif  
 
-/* Make soft and hardlinks for executable and dynamic libraries */
+/* Make hardlinks for dynamic libraries */
 	nocheck(mkdir,(libDir,0755)); /* fill up lib directory with needed libs */
-	nocheck(system,("/bin/ln -f '" libSrc "'/* " libDir));
+	link_libs();
+}
 
+/* Run this program (args[0] is in the run directory, our current 
+  directory, as exeName) in the jail, and kill it after runTime.  
+  Never returns. */
+void run_jailed(char **args,int jail) {
+	struct itimerval itimer;
 	signal(SIGALRM,signalHandler);
+	nocheck(seteuid,(0));
+	
+/* Benchmark runs wait for a reserved CPU first, and every run for a 
+  user ID, on their own time */
+	if (benchCPUs[0]) pick_cpu();
+	pick_user();
 
 /* Request a SIGALRM after runTime seconds */
 	itimer.it_interval.tv_sec=0;
@@ -149,6 +602,13 @@ int main(int argc,char *argv[]){
 	itimer.it_value.tv_usec=0;
 	check(setitimer,(ITIMER_REAL, &itimer, NULL)); 
 	
+/* Account for the program, and anything it leaves running */
+	make_cgroup();
+	if (cpuSet[0]) cgroup_write("cpuset.cpus",cpuSet);
+#ifdef __linux__
+	prctl(PR_SET_CHILD_SUBREAPER,1);
+#endif
+	
 /* su and chroot.  WARNING: REMAINING PARENT CODE RUNS AS ROOT! 
   Rationale: Parent can't be same nobody user as the child code, 
   since then the child code could kill off its controlling parent.
@@ -156,9 +616,14 @@ int main(int argc,char *argv[]){
   kill a process you don't own.
 */
 	check(setuid,(0));
-	check(chroot,("."));
+	if (jail) {
+		check(chroot,(jailSrc));
+		check(chdir,("/" runDir));
+	}
+	else check(chroot,("."));
 	
 /* Run program */
+	gettimeofday(&startTime,NULL);
 	childPID=fork();
 	if (childPID==0) { /* we're the child! */
 		/* Stuff child into separate process group; see
@@ -168,29 +633,349 @@ int main(int argc,char *argv[]){
 		leaving some fork'ed grandchildren outside the process group...
 		*/
 		setpgid(0,0); 
+		if (cgProcsFD>=0) { /* move into our cgroup (before forking anything) */
+			write(cgProcsFD,"0",1);
+			close(cgProcsFD);
+		}
+		pin_cpus(); /* (even without a cgroup cpuset) */
 		
-		/* Child process always runs as nobody user */
-		check(setuid,(runUser));
+		/* Child process always runs as an unprivileged user, 
+		   all its own (so it can't touch other runs' programs) */
+		check(setuid,(jobUser));
 	
 	/* Decrease resource limits, so child can't make much trouble... */
 		nice(5); /* don't hammer CPU */
 		my_limit(RLIMIT_CORE,0); /* size of core file */
 		my_limit(RLIMIT_CPU,runTime+1); /* seconds of CPU (backup, in case parent fails) */
-		my_limit(RLIMIT_DATA,100*1024*1024); /* bytes of brk()  */
-		my_limit(RLIMIT_RSS,100*1024*1024); /* bytes of resident RAM */
+		my_limit(RLIMIT_DATA,runMem); /* bytes of brk()  */
+		if (!cgMemory) my_limit(RLIMIT_RSS,runMem); /* bytes of resident RAM (ignored by Linux) */
 		my_limit(RLIMIT_FSIZE,1*1024*1024); /* bytes of created files size */
 		my_limit(RLIMIT_MEMLOCK,1*1024*1024); /* bytes of locked memory */
 		my_limit(RLIMIT_NOFILE,100); /* number of open files */
-		my_limit(RLIMIT_NPROC,9); /* number of fork'd processes/threads (0==disable fork entirely)  */
+		if (!cgPids) my_limit(RLIMIT_NPROC,runProcs); /* number of fork'd processes/threads (0==disable fork entirely)  */
 		/* FIXME: remaining vulnerabilities: outgoing network traffic */
 	
-		execv(exeName,&argv[1]);
+		execv(exeName,args);
 		perror("execv failure");
 		printf("Sadly, execv('%s') failed.  This is usually a shared library problem--check 'ldd %s/%s', and make sure all listed libraries are in the '%s' directory (and copied into '%s/%s').\n", exeName, runDir,exeName, libSrc, runDir,libDir);
-
+		exit(1);
 	} else { /* parent--wait for child */
 		waitForChild(0);
 	}
-        return(0);
+	exit(0);
+}
+
+/*************** Fork server **************
+ "s4g_chroot -d", started by root, listens on a Unix socket, and keeps
+ serverPool handlers ready to go: each has already forked, made its 
+ own mount namespace with the jail template mounted, and made its 
+ cgroup, so a run only has to mount its run directory and start.
+ 
+ Each run request carries the run directory, stdin, stdout, and stderr
+ (as file descriptors), the CPUs to run on (and reserved CPUs, for
+ a benchmark run), and the program's arguments.  The handler that 
+ takes it runs the program exactly like run_jailed.  The client is 
+ s4g_run (this built with -DclientOnly, not setuid), which just 
+ creates the run directory, hands it over, and waits for the handler 
+ to send runDone and hang up; if the client goes away first, the 
+ handler kills the run.  Without a server, s4g_run execs s4g_chroot.
+*/
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Unix socket the server listens on (S4G_SERVER overrides this) */
+#ifndef serverSock
+#  define serverSock "/run/s4g_chroot.sock"
+#endif
+#ifndef serverPool
+#  define serverPool 4 /* handlers the server keeps set up and waiting */
+#endif
+enum {
+	max_request=64*1024, /* bytes of arguments */
+	max_args=1024,
+	request_fds=4 /* run directory, stdin, stdout, stderr */
+};
+
+/* Return the Unix socket address of the server */
+struct sockaddr_un server_addr(void) {
+	struct sockaddr_un a;
+	const char *path=getenv("S4G_SERVER");
+	if (path==NULL) path=serverSock;
+	memset(&a,0,sizeof(a));
+	a.sun_family=AF_UNIX;
+	strncpy(a.sun_path,path,sizeof(a.sun_path)-1);
+	return a;
+}
+
+/* Connect to the server, or return -1 if it's not running */
+int connect_server(void) {
+	struct sockaddr_un a=server_addr();
+	int s=socket(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0);
+	if (s<0) return -1;
+	if (0!=connect(s,(struct sockaddr *)&a,sizeof(a))) { close(s); return -1; }
+	return s;
+}
+
+/* Ask the server (connected on s) to run this program in the run 
+  directory (our current directory).  Waits for the program and 
+  never returns, unless the request couldn't be sent. */
+void run_by_server(int s,char **args) {
+	char buf[max_request];
+	union { /* (aligned for cmsghdr) */
+		char buf[CMSG_SPACE(request_fds*sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr m;
+	struct iovec v;
+	struct cmsghdr *c;
+	int fds[request_fds]={-1,0,1,2};
+	int i, len, done=0;
+	
+	/* CPUs, benchmark CPUs, then arguments, each ending in a nul */
+	strcpy(buf,cpuSet);
+	len=strlen(cpuSet)+1;
+	strcpy(buf+len,benchCPUs);
+	len+=strlen(benchCPUs)+1;
+	for (i=0;args[i]!=NULL;i++) {
+		int n=strlen(args[i])+1;
+		if (len+n>max_request) { close(s); return; }
+		memcpy(buf+len,args[i],n);
+		len+=n;
+	}
+	
+	fds[0]=open(".",O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fds[0]<0) { close(s); return; }
+	
+	memset(&m,0,sizeof(m));
+	v.iov_base=buf; v.iov_len=len;
+	m.msg_iov=&v; m.msg_iovlen=1;
+	m.msg_control=ctl.buf; m.msg_controllen=sizeof(ctl.buf);
+	c=CMSG_FIRSTHDR(&m);
+	c->cmsg_level=SOL_SOCKET;
+	c->cmsg_type=SCM_RIGHTS;
+	c->cmsg_len=CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c),fds,sizeof(fds));
+	if (sendmsg(s,&m,0)!=len) { close(s); close(fds[0]); return; }
+	close(fds[0]);
+	
+	/* The server sends back the accounting line, then runDone, and 
+	   hangs up once the program is done.  Hanging up without runDone 
+	   means the handler failed: it printed why. */
+	while ((len=read(s,buf,sizeof(buf)))>0) {
+		if (len==(int)strlen(runDone) && 0==memcmp(buf,runDone,len)) done=1;
+		else if (reportFD>=0) write(reportFD,buf,len);
+	}
+	if (!done) {
+		printf("s4g_chroot: fork server failed to run the program\n");
+		exit(1);
+	}
+	exit(0);
+}
+
+/* Handle one run request on this connection, in a handler that's 
+  already in the jail if jail is 1.  Never returns.
+  WARNING: This routine runs as root! */
+void serve_request(int s,int jail) {
+	char buf[max_request+1], name[100], path[4096];
+	union { /* (aligned for cmsghdr) */
+		char buf[CMSG_SPACE(request_fds*sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	char *args[max_args+1];
+	struct msghdr m;
+	struct iovec v;
+	struct cmsghdr *c;
+	struct ucred cred;
+	struct stat here, there;
+	socklen_t credLen=sizeof(cred);
+	int fds[request_fds];
+	int i, n, nArgs=0;
+	
+	/* Jailed programs can't ask for more runs */
+	if (0!=getsockopt(s,SOL_SOCKET,SO_PEERCRED,&cred,&credLen) || 
+	    (cred.uid>=runUser && cred.uid<runUser+runUsers))
+		exit(1);
+	
+	memset(&m,0,sizeof(m));
+	v.iov_base=buf; v.iov_len=max_request;
+	m.msg_iov=&v; m.msg_iovlen=1;
+	m.msg_control=ctl.buf; m.msg_controllen=sizeof(ctl.buf);
+	n=recvmsg(s,&m,MSG_CMSG_CLOEXEC);
+	c=CMSG_FIRSTHDR(&m);
+	if (n<=0 || (m.msg_flags&(MSG_TRUNC|MSG_CTRUNC)) || c==NULL ||
+	    c->cmsg_type!=SCM_RIGHTS || c->cmsg_len!=CMSG_LEN(sizeof(fds)))
+		exit(1);
+	memcpy(fds,CMSG_DATA(c),sizeof(fds));
+	
+	buf[n]=0; /* split up the CPUs and arguments */
+	set_cpus(cpuSet,buf);
+	i=strlen(buf)+1;
+	if (i<n) {
+		set_cpus(benchCPUs,buf+i);
+		i+=strlen(buf+i)+1;
+	}
+	for (;i<n && nArgs<max_args;i+=strlen(buf+i)+1)
+		args[nArgs++]=buf+i;
+	args[nArgs]=NULL;
+	if (nArgs==0) exit(1);
+	
+	/* The client's run directory comes from the mounts outside, which
+	   we can't bind-mount from; find it again by name in our own 
+	   (made ahead of time) mount namespace.  If it's not the same
+	   directory there, build the jail in it the old way, as the client. */
+	snprintf(name,sizeof(name),"/proc/self/fd/%d",fds[0]);
+	n=readlink(name,path,sizeof(path)-1);
+	if (n>0) path[n]=0;
+	if (!(jail && n>0 && 0==chdir(path) && 0==stat(".",&here) && 
+	      0==fstat(fds[0],&there) && here.st_dev==there.st_dev && 
+	      here.st_ino==there.st_ino && mount_run()))
+	{
+		jail=0;
+		check(fchdir,(fds[0]));
+		check(setegid,(cred.gid));
+		check(seteuid,(cred.uid));
+		link_jail();
+		check(seteuid,(0));
+		check(setegid,(0));
+	}
+	
+	/* Take on the client's standard I/O */
+	for (i=0;i<3;i++) dup2(fds[1+i],i);
+	for (i=0;i<request_fds;i++) close(fds[i]);
+	reportFD=clientFD=s; /* accounting goes back to the client */
+	signal(SIGPIPE,SIG_IGN); /* (which may hang up on us) */
+	
+	run_jailed(args,jail);
+}
+
+/* Start a handler, which sets up everything it can, then waits for
+  a run request on the listening socket l, and writes its pid to 
+  ready once it has one.  Returns the handler's pid. */
+pid_t start_handler(int l,int ready) {
+	pid_t pid=fork();
+	int jail, s;
+	if (pid!=0) return pid;
+	
+	jail=mount_template(); /* our own mount namespace, for just this run */
+	make_cgroup();
+	while ((s=accept4(l,NULL,NULL,SOCK_CLOEXEC))<0) {}
+	pid=getpid();
+	write(ready,&pid,sizeof(pid)); /* the server starts our replacement */
+	close(l); close(ready);
+	serve_request(s,jail);
+	return 0;
+}
+
+/* Run the fork server.  Never returns. */
+void serve(void) {
+	struct sockaddr_un a=server_addr();
+	pid_t idle[serverPool], pid;
+	int l, i, status, ready[2];
+	if (getuid()!=0) {
+		printf("s4g_chroot -d must be started by root.\n");
+		exit(1);
+	}
+	check(setuid,(0));
+	if (0!=access(jailSrc "/" runDir,R_OK)) {
+		printf("s4g_chroot -d needs the jail template in '" jailSrc "'.\n");
+		exit(1);
+	}
+	
+	l=socket(AF_UNIX,SOCK_SEQPACKET|SOCK_CLOEXEC,0);
+	if (l<0) bad(l,"socket");
+	unlink(a.sun_path);
+	check(bind,(l,(struct sockaddr *)&a,sizeof(a)));
+	check(chmod,(a.sun_path,0666)); /* anybody can run programs, like with setuid */
+	check(listen,(l,SOMAXCONN));
+	check(pipe2,(ready,O_CLOEXEC));
+	
+	/* Keep serverPool handlers waiting, replacing each one as it takes 
+	   a run (or dies before it gets one) */
+	for (i=0;i<serverPool;i++) idle[i]=start_handler(l,ready[1]);
+	while (1) {
+		struct pollfd p;
+		p.fd=ready[0]; p.events=POLLIN; p.revents=0;
+		if (poll(&p,1,1000)>0 && read(ready[0],&pid,sizeof(pid))==sizeof(pid))
+			for (i=0;i<serverPool;i++)
+				if (idle[i]==pid) idle[i]=start_handler(l,ready[1]);
+		while ((pid=waitpid(-1,&status,WNOHANG))>0) /* done with its run */
+			for (i=0;i<serverPool;i++)
+				if (idle[i]==pid) idle[i]=start_handler(l,ready[1]);
+	}
 }
+#else
+int connect_server(void) {return -1;}
+void run_by_server(int s,char **args) {}
+void serve(void) {
+	printf("s4g_chroot -d needs Linux.\n");
+	exit(1);
+}
+#endif
+
+int main(int argc,char *argv[]){ 
+	int jail, server=-1;
+	
+#ifdef clientOnly
+/* s4g_run: without a fork server, the setuid s4g_chroot does it all */
+	if (argc<=1 || 0==strcmp(argv[1],"-d") || (server=connect_server())<0) {
+		execv(s4gPath,argv);
+		perror("s4g_run: can't run " s4gPath);
+		return 1;
+	}
+#endif
+	
+/* Paranoia */
+	seteuid(getuid()); /* give up setuid privileges before doing anything else http://yarchive.net/comp/setuid_mess.html */
+	unsetenv("IFS"); /* used by shell */
+	unsetenv("PATH");
+	unsetenv("LD_LIBRARY_PATH");
+	/*clearenv();*/
+	if (getenv("S4G_CPUS")!=NULL) set_cpus(cpuSet,getenv("S4G_CPUS"));
+	if (getenv("S4G_BENCH")!=NULL && getenv("S4G_BENCH_CPUS")!=NULL)
+		set_cpus(benchCPUs,getenv("S4G_BENCH_CPUS")); /* benchmark run */
+	if (getenv("S4G_REPORT")!=NULL) { /* opened as the caller, not root */
+		reportFD=open(getenv("S4G_REPORT"),O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,0644);
+#ifndef clientOnly /* (s4g_run may yet pass it on to s4g_chroot) */
+		unsetenv("S4G_REPORT");
+#endif
+	}
+
+/* Parse command line */
+	if (argc==2 && 0==strcmp(argv[1],"-d")) serve();
+	if (argc<=1) {
+		printf("Usage: s4g_chroot <exe> <args>\n"
+			"   Runs this executable in a little chroot jail built in the '" runDir "' directory.\n"
+			"   or: s4g_chroot -d\n"
+			"   Runs a server (as root) that does the chroot jail setup for later runs.\n");
+		return 1;
+	}
+	
+/* Create rundir */
+	//check(system,("/bin/rm -fr "runDir)); /* (leftover stuff could be sensitive or dangerous) */
+	nocheck(mkdir,(runDir,0777)); /* 777 since program needs to be able to create files... */
+	nocheck(chmod,(runDir,0777)); /* override umask */
+	nocheck(link,(argv[1],runDir "/" exeName)); /* hardlink over executable */
+	check(chdir,(runDir)); /* everything else happens inside the run directory */
 
+/* Let the fork server do the rest, if it's running */
+#ifndef clientOnly
+	server=connect_server();
+#endif
+	if (server>=0) run_by_server(server,&argv[1]);
+#ifdef clientOnly
+	check(chdir,("..")); /* couldn't send it: s4g_chroot can still run it */
+	execv(s4gPath,argv);
+	perror("s4g_run: can't run " s4gPath);
+	return 1;
+#endif
+
+/* Use the prebuilt jail, if we can (this needs root for a moment) */
+	nocheck(seteuid,(0));
+	jail=mount_template() && mount_run(); /* (a half-built one is private) */
+	nocheck(seteuid,(getuid()));
+	if (!jail) link_jail();
+	
+	run_jailed(&argv[1],jail);
+	return 0;
+}
@@ -23,7 +23,9 @@ int good_rand(void) {
 
 
 auth_pipe::auth_pipe(const char *sharedSecret_,dir_t d,SOCKET fd_)
-	:fd(fd_),sharedSecret(sharedSecret_),state(state_idle)
+	:fd(fd_),sharedSecret(sharedSecret_),mac(mac_sha1),
+	 hmac(sharedSecret_,strlen(sharedSecret_)),chunked(false),more(false),
+	 dir(d),duplex(false),queued(false),outidx(0),state(state_idle)
 {
 	int n;
 	Big32 my[n_nonce], his[n_nonce];
@@ -36,18 +38,69 @@ auth_pipe::auth_pipe(const char *sharedSecret_,dir_t d,SOCKET fd_)
 	}
 	count=0;
 }
-void auth_pipe::reset(void) {
-	h.end(); /* Clean out any invalid data */
-	h.addBytes(&nonce,sizeof(nonce)); /* Add nonces to hash */
-	count=count+1;
-	h.addBytes(&count,sizeof(count)); /* Add count to hash */
-	h.addBytes(sharedSecret,strlen(sharedSecret)); /* Add secret to hash */
+void auth_pipe::reset(bool sending) {
+	Big32 c;
+	if (duplex) { /* each direction has its own count */
+		Big32 &dc=sending?sendCount:recvCount;
+		dc=dc+1;
+		c=dc;
+	} else {
+		count=count+1;
+		c=count;
+	}
+	if (mac==mac_sha1) {
+		h.end(); /* Clean out any invalid data */
+		h.addBytes(&nonce,sizeof(nonce)); /* Add nonces to hash */
+		h.addBytes(&c,sizeof(c)); /* Add count to hash */
+	} else {
+		h256=hmac.start(); /* secret is already in the keyed state */
+		h256.addBytes(&nonce,sizeof(nonce));
+		h256.addBytes(&c,sizeof(c));
+	}
+	if (duplex) { /* who sent it, so messages can't be reflected back */
+		Big32 who=sending?dir:!dir;
+		mac_add(&who,sizeof(who));
+	}
+	if (mac==mac_sha1) h.addBytes(sharedSecret,strlen(sharedSecret)); /* Add secret to hash */
 	msgidx=0;
 }
 
+void auth_pipe::mac_add(const void *b,int len) {
+	if (mac==mac_sha1) h.addBytes(b,len);
+	else h256.addBytes(b,len);
+}
+
+int auth_pipe::mac_end(byte *dest) {
+	if (mac==mac_sha1) {
+		SHA1_hash_t hc=h.end();
+		memcpy(dest,&hc,sizeof(hc));
+		return sizeof(hc);
+	} else {
+		osl::SHA256_hash_t hc=hmac.end(h256);
+		memcpy(dest,&hc,sizeof(hc));
+		return sizeof(hc);
+	}
+}
+
+void auth_pipe::set_mac(mac_t m) {
+	flush();
+	mac=m;
+}
+
+void auth_pipe::set_chunked(bool c) {
+	flush();
+	chunked=c;
+}
+
+void auth_pipe::set_duplex(void) {
+	flush();
+	duplex=true;
+	sendCount=recvCount=count;
+}
+
 void auth_pipe::send_start(void) {
 	if (state==state_recv) recv_done();
-	reset();
+	reset(true);
 	state=state_send;
 }
 
@@ -56,50 +109,178 @@ void auth_pipe::send(const void *b,int len)
 	if (state!=state_send) send_start();
 	msg.resize(msgidx+len);
 	memcpy(&msg[msgidx],b,len);
-	h.addBytes(b,len);
+	mac_add(b,len);
 	msgidx+=len;
 }
 void auth_pipe::send_done(void)
 {
 	if (state!=state_send) skt_call_abort("Logic error: send_done called outside send mode!");
 
-	// Send message length
+	// Send message length, message data, and hashcode
 	Big32 msglen=msgidx;
-	skt_sendN(fd,&msglen,sizeof(msglen));
-	
-	// Append hashcode to message data & send
-	SHA1_hash_t hc=h.end();
-	send((const byte *)&hc,sizeof(hc)); 
-	skt_sendN(fd,&msg[0],msglen+sizeof(hc));
+	if (chunked) mac_add(&msglen,sizeof(msglen));
+	byte hc[mac_max];
+	int hlen=mac_end(hc);
+	const void *bufs[3]={&msglen,msgidx>0?&msg[0]:hc,hc}; /* (msg may be empty) */
+	int lens[3]={sizeof(msglen),msgidx,hlen};
+	put(3,bufs,lens);
 
 	msg.resize(0);
 	state=state_idle;
 }
 
+void auth_pipe::send_wire(int nBuffers,const void **bufs,const int *lens,bool more)
+{
+	if (nBuffers>send_maxBuffers) skt_call_abort("Logic error: too many buffers passed to send_msgV!");
+	if (more && !chunked) skt_call_abort("Logic error: sending a piece without chunked messages!");
+	flush();
+	reset(true);
+	
+	// Hash the pieces in place
+	const void *vbufs[skt_sendV_maxBuffers];
+	int vlens[skt_sendV_maxBuffers];
+	int msglen=0;
+	for (int i=0;i<nBuffers;i++) {
+		mac_add(bufs[i],lens[i]);
+		vbufs[1+i]=bufs[i]; vlens[1+i]=lens[i];
+		msglen+=lens[i];
+	}
+	if (msglen>=msg_max) skt_call_abort("Logic error: message too long to send!");
+	
+	// Length, pieces, and hashcode all go out together
+	Big32 bigLen=msglen|(more?msglen_more:0);
+	if (chunked) mac_add(&bigLen,sizeof(bigLen));
+	byte hc[mac_max];
+	vbufs[0]=&bigLen; vlens[0]=sizeof(bigLen);
+	vlens[1+nBuffers]=mac_end(hc); vbufs[1+nBuffers]=hc;
+	put(nBuffers+2,vbufs,vlens);
+}
+
+void auth_pipe::put(int nBuffers,const void **bufs,int *lens)
+{
+	if (!queued) { skt_sendV(fd,nBuffers,bufs,lens); return; }
+	for (int i=0;i<nBuffers;i++) {
+		const byte *b=(const byte *)bufs[i];
+		outq.insert(outq.end(),b,b+lens[i]);
+	}
+}
+
+int auth_pipe::send_some(void)
+{
+	int left=outq.size()-outidx;
+	if (left>0) outidx+=skt_send_some(fd,&outq[outidx],left);
+	if (outidx==(int)outq.size()) { outq.resize(0); outidx=0; }
+	else if (outidx>=(int)outq.size()/2) { /* don't let the sent part pile up */
+		outq.erase(outq.begin(),outq.begin()+outidx);
+		outidx=0;
+	}
+	return outq.size()-outidx;
+}
+
+void auth_pipe::set_queued(bool q)
+{
+	if (!q && outidx<(int)outq.size()) /* the rest goes out now */
+		skt_sendN(fd,&outq[outidx],outq.size()-outidx);
+	if (!q) { outq.resize(0); outidx=0; }
+	queued=q;
+}
+
+void auth_pipe::send_msgV(int nBuffers,const void **bufs,const int *lens)
+{
+	send_wire(nBuffers,bufs,lens,false);
+}
+
+void auth_pipe::send_piece(const void *b,int len,bool more)
+{
+	send_wire(1,&b,&len,more);
+}
+
+void auth_pipe::send_pieceV(int nBuffers,const void **bufs,const int *lens,bool more)
+{
+	send_wire(nBuffers,bufs,lens,more);
+}
+
+void auth_pipe::send_big(const void *b,long len)
+{
+	if (!chunked) { send_msg(b,len); return; }
+	const byte *ptr=(const byte *)b;
+	do {
+		int n=(len>chunk_max)?chunk_max:len;
+		len-=n;
+		send_piece(ptr,n,len>0);
+		ptr+=n;
+	} while (len>0);
+}
+
 int auth_pipe::recv_start(int expect)
 {
 	flush();
-	reset();
+	reset(false);
 	state=state_recv;
 	
 	// Grab message length
-	Big32 msglen;
-	skt_recvN(fd,&msglen,sizeof(msglen));
-	if ((expect!=-1) && ((int)msglen!=expect)) skt_call_abort("Security error: message length mismatch!");
-	if (msglen<0 || msglen>=10*1024*1024) skt_call_abort("Security error: message length bogus!");
+	Big32 wireLen;
+	take(&wireLen,sizeof(wireLen));
+	unsigned int msglen=wireLen;
+	more=false;
+	if (chunked && (msglen&msglen_more)) {
+		more=true;
+		msglen&=~msglen_more;
+	}
+	if ((expect!=-1) && (more || (int)msglen!=expect)) skt_call_abort("Security error: message length mismatch!");
+	if (msglen>=msg_max) skt_call_abort("Security error: message length bogus!");
 	
 	// Grab message data + hash code
-	msgidx=msglen+sizeof(SHA1_hash_t);
+	int hlen=mac_len();
+	msgidx=msglen+hlen;
 	msg.resize(msgidx);
-	skt_recvN(fd,&msg[0],msgidx);
-	h.addBytes(&msg[0],msglen);
-	SHA1_hash_t hc=h.end();
-	if (SHA1_differ(&hc,(const SHA1_hash_t *)&msg[msglen])) skt_call_abort("Security error: message auth mismatch!\n");
+	take(&msg[0],msgidx);
+	mac_add(&msg[0],msglen);
+	if (chunked) mac_add(&wireLen,sizeof(wireLen));
+	byte hc[mac_max];
+	mac_end(hc);
+	if (0!=memcmp(hc,&msg[msglen],hlen)) skt_call_abort("Security error: message auth mismatch!\n");
 	msg.resize(msglen); /* Clip off hash code, so it doesn't get returned */
 	msgidx=0;
 	return msglen;
 }
 
+int auth_pipe::in_need(void) const
+{
+	Big32 wireLen;
+	if (inq.size()<sizeof(wireLen)) return sizeof(wireLen);
+	memcpy(&wireLen,&inq[0],sizeof(wireLen));
+	unsigned int msglen=wireLen;
+	if (chunked) msglen&=~msglen_more;
+	if (msglen>=msg_max) return inq.size(); /* bogus: recv_start will complain */
+	return sizeof(wireLen)+msglen+mac_len();
+}
+
+bool auth_pipe::recv_some(void)
+{
+	int need;
+	while ((int)inq.size()<(need=in_need())) {
+		int have=inq.size();
+		inq.resize(need);
+		int n=skt_recv_some(fd,&inq[have],need-have);
+		if (n<0) skt_call_abort("Socket closed before recv.");
+		inq.resize(have+n);
+		if (n==0) return false; /* rest isn't here yet */
+	}
+	return true;
+}
+
+void auth_pipe::take(void *dest,int len)
+{
+	int n=inq.size();
+	if (n>len) n=len;
+	if (n>0) {
+		memcpy(dest,&inq[0],n);
+		inq.erase(inq.begin(),inq.begin()+n);
+	}
+	if (n<len) skt_recvN(fd,n+(byte *)dest,len-n);
+}
+
 const byte *auth_pipe::recv(int len)
 {
 	if (state!=state_recv) recv_start();
@@ -134,5 +315,6 @@ void auth_pipe::flush(void) {
 
 auth_pipe::~auth_pipe() {
 	flush();
+	set_queued(false);
 	skt_close(fd);
 }
@@ -5,6 +5,7 @@ Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
 
 #include "sockRoutines.h"
 #include "osl/sha1.h"
+#include "osl/sha256.h"
 #include <vector>
 
 /* 
@@ -29,12 +30,36 @@ int good_rand(void);
 		shared secret (see "reset" routine)
 		s-byte data
 	>
+ 
+ Once both sides agree (see set_mac), the SHA-1 hash code is
+ replaced by a 32-byte HMAC-SHA-256, keyed with the shared secret, of:
+		4 nonces picked by side A.
+		4 nonces picked by side B.
+		big endian 32-bit message count
+		s-byte data
+ 
+ Messages are limited to msg_max bytes.  Once both sides agree 
+ (see set_chunked), a long message can instead be sent as a series
+ of pieces, each authenticated separately: pieces with the msglen_more
+ bit set in their size field have more pieces following.  In this 
+ mode the MAC also covers the 32-bit size field (after the data),
+ so pieces can't be cut off or run together.
+ 
+ Normally the two sides take turns, and share one message count.
+ Once both sides agree (see set_duplex), both can send at once: 
+ each direction counts its own messages, and the MAC also covers
+ which side (A=0 or B=1) sent the message, after the count.
 */
 class auth_pipe {
 public:
 	typedef enum {
 		dir_A=0, dir_B=1
 	} dir_t;
+	/* Message authentication code used on the wire */
+	typedef enum {
+		mac_sha1=0, /* original SHA-1 of nonces, count, secret, data */
+		mac_hmac_sha256=1 /* HMAC-SHA-256 of nonces, count, data */
+	} mac_t;
 	/*
 	  Prepare to send and receive messages on this socket.
 	  Either side can send or receive messages repeatedly,
@@ -56,6 +81,27 @@ public:
 	   Called by default when switching to a receive.
 	*/
 	void send_done(void);
+	
+	/* Send this whole message, made of nBuffers pieces, straight
+	   out of the caller's buffers: hashed in place, no copy, and
+	   length, pieces, and hash go out in one vectored write.
+	   Don't use more than send_maxBuffers pieces.
+	*/
+	enum {send_maxBuffers=skt_sendV_maxBuffers-2};
+	void send_msgV(int nBuffers,const void **bufs,const int *lens);
+	/* As above, for a message in a single buffer. */
+	void send_msg(const void *b,int len) {send_msgV(1,&b,&len);}
+	
+	/* Send one piece of a chunked message.  If more is true, 
+	   the receiver will get more pieces after this one. 
+	   Only works after set_chunked. */
+	void send_piece(const void *b,int len,bool more);
+	/* As above, for a piece made of nBuffers pieces. */
+	void send_pieceV(int nBuffers,const void **bufs,const int *lens,bool more);
+	
+	/* Send this message of any length, split into chunk_max pieces
+	   if chunked messages are allowed. */
+	void send_big(const void *b,long len);
 
 /* Receiving protocol: */
 	/* Return how many bytes have arrived in this message. 
@@ -77,8 +123,49 @@ public:
 	/* Return bytes left to receive */
 	int recv_left(void);
 	
+	/* Return true if the current message is a piece of a chunked 
+	   message, and more pieces follow.  Get them with recv_start. */
+	bool recv_more(void) const {return more;}
+	
+	/* Read whatever part of the next message the socket has right 
+	   now, without waiting.  Returns true once the whole message is 
+	   here, so recv_start won't wait for it.  A server juggling many
+	   things calls this when the socket is readable. */
+	bool recv_some(void);
+	
+	/* Queue outgoing messages from here on, rather than waiting to 
+	   send them, so a server juggling many things never blocks 
+	   sending.  Queued bytes leave as send_some finds room; switching
+	   queueing off (or deleting the pipe) sends the rest, waiting.  */
+	void set_queued(bool q);
+	/* Send as much of the queue as the socket will take right now. 
+	   Returns the number of bytes still queued. */
+	int send_some(void);
+	/* Return the number of bytes queued but not yet sent */
+	int send_left(void) const {return outq.size()-outidx;}
+	
 	/* Finish any ongoing communication */
 	void flush(void);
+	
+	/* Switch to this message authentication code.  Both sides 
+	   must switch at the same point in the message stream. */
+	void set_mac(mac_t m);
+	
+	/* Allow chunked messages from here on.  Both sides must 
+	   switch at the same point in the message stream. */
+	void set_chunked(bool c);
+	
+	/* Let both sides send at the same time from here on.  Both 
+	   sides must switch at the same point in the message stream,
+	   and can't switch back.  Each message must still be sent or
+	   received as a unit, with send_msgV or recv_start...recv_done. */
+	void set_duplex(void);
+	
+	enum {
+		msg_max=10*1024*1024, /* longest single message or piece */
+		chunk_max=1024*1024 /* size of pieces sent by send_big */
+	};
+	enum {msglen_more=0x80000000u}; /* size-field bit: more pieces follow */
 
 private:
 	/* Message data, as going to or coming from the network */
@@ -87,15 +174,46 @@ private:
 	SOCKET fd;
 	/* Hash of message data received so far */
 	osl::SHA1_hasher h;
+	osl::SHA256_hasher h256;
 	/* Shared secret ASCII string */
 	const char *sharedSecret;
+	/* Current MAC, and its keyed state */
+	mac_t mac;
+	osl::HMAC_SHA256 hmac;
+	/* Chunked messages are allowed; current message has more pieces */
+	bool chunked, more;
+	/* Our side, and whether each direction keeps its own count */
+	dir_t dir;
+	bool duplex;
+	/* Outgoing messages are queued; the queue, sent up to outidx */
+	bool queued;
+	std::vector<byte> outq;
+	int outidx;
+	/* Bytes of the next incoming message, read early by recv_some */
+	std::vector<byte> inq;
+	/* Wire bytes in the next incoming message, judging by inq */
+	int in_need(void) const;
+	/* Receive len wire bytes, from inq first, then the socket */
+	void take(void *dest,int len);
 	/* Nonces (random numbers) shared by sender and receiver */
 	enum {n_nonce=4}; /*Nonces per send side */
 	Big32 nonce[2*n_nonce];
-	/* Message count, as Big32 integer */
-	Big32 count;
-	/* Reset hasher & prepare for a new hash */
-	void reset(void);
+	/* Message count, as Big32 integer; in duplex mode, per direction */
+	Big32 count, sendCount, recvCount;
+	/* Reset hasher & prepare to hash a message we're sending or receiving */
+	void reset(bool sending);
+	/* Add message data to the current MAC */
+	void mac_add(const void *b,int len);
+	/* Finish the current MAC, writing mac_max or fewer bytes to dest.
+	   Returns the number of bytes written. */
+	enum {mac_max=32};
+	int mac_end(byte *dest);
+	/* Send these pieces as one message, with this size field */
+	void send_wire(int nBuffers,const void **bufs,const int *lens,bool more);
+	/* Send (or queue) these finished bytes */
+	void put(int nBuffers,const void **bufs,int *lens);
+	/* Bytes of MAC on the wire */
+	int mac_len(void) const {return mac==mac_sha1?sizeof(osl::SHA1_hash_t):sizeof(osl::SHA256_hash_t);}
 	typedef enum {
 		state_idle=0, state_send, state_recv
 	} state_t;
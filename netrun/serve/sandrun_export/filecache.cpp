@@ -0,0 +1,191 @@
+/* Content-addressed file cache.
+
+Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+*/
+#include "filecache.h"
+#include "sockRoutines.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#  include <linux/fs.h> /* for FICLONE */
+#endif
+
+file_cache::file_cache(const std::string &dir_)
+	:dir(dir_),nTemp(0)
+{
+	mkdir(dir.c_str(),0700);
+}
+
+std::string file_cache::hex(const osl::SHA256_hash_t &h)
+{
+	static const char digits[]="0123456789abcdef";
+	std::string s;
+	for (unsigned int i=0;i<sizeof(h.data);i++) {
+		s+=digits[h.data[i]>>4];
+		s+=digits[h.data[i]&0xf];
+	}
+	return s;
+}
+
+bool file_cache::unhex(const char *str,osl::SHA256_hash_t &h)
+{
+	for (unsigned int i=0;i<2*sizeof(h.data);i++) {
+		char c=str[i];
+		int v;
+		if (c>='0' && c<='9') v=c-'0';
+		else if (c>='a' && c<='f') v=c-'a'+10;
+		else return false;
+		if (i%2==0) h.data[i/2]=v<<4;
+		else h.data[i/2]|=v;
+	}
+	return true;
+}
+
+std::string file_cache::path(const osl::SHA256_hash_t &h,bool exec) const
+{
+	std::string x=hex(h);
+	return dir+x.substr(0,2)+"/"+x+(exec?"x":"");
+}
+
+std::string file_cache::temp_name(void)
+{
+	char name[100];
+	sprintf(name,"tmp.%d.%d",(int)getpid(),nTemp++);
+	return dir+name;
+}
+
+bool file_cache::has(const osl::SHA256_hash_t &h) const
+{
+	return 0==access(path(h,false).c_str(),F_OK);
+}
+
+bool copy_file(const std::string &src,const std::string &dest,int mode)
+{
+	int in=open(src.c_str(),O_RDONLY|O_CLOEXEC);
+	if (in<0) return false;
+	int out=open(dest.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0600);
+	if (out<0) { close(in); return false; }
+	bool ok=true;
+#ifdef FICLONE
+	if (0!=ioctl(out,FICLONE,in))
+#endif
+	{ /* no reflinks here: copy the bytes */
+		char buf[65536];
+		int n;
+		while (ok && (n=read(in,buf,sizeof(buf)))!=0) {
+			if (n<0) { if (errno!=EINTR) ok=false; continue; }
+			if (n!=write(out,buf,n)) ok=false;
+		}
+	}
+	fchmod(out,mode);
+	close(in);
+	if (0!=close(out)) ok=false;
+	return ok;
+}
+
+bool file_cache::materialize(const osl::SHA256_hash_t &h,const std::string &dest,int mode,long mtime)
+{
+	bool exec=(mode&0111)!=0;
+	std::string src=path(h,exec);
+	if (exec && 0!=access(src.c_str(),F_OK)) { /* make the executable copy */
+		std::string tmp=temp_name();
+		if (!copy_file(path(h,false),tmp,0555)) {
+			unlink(tmp.c_str());
+			if (!has(h)) return false; /* evicted under us */
+			skt_call_abort("Error making executable cache file");
+		}
+		if (0!=rename(tmp.c_str(),src.c_str())) skt_call_abort("Error making executable cache file");
+	}
+	utimes(src.c_str(),NULL); /* mark it used */
+	unlink(dest.c_str());
+	
+	/* Always a separate inode (never a hard link), so the job gets
+	  its own mode and mtime, and can't write through to the cache. */
+	if (!copy_file(src,dest,mode)) {
+		unlink(dest.c_str());
+		if (0!=access(src.c_str(),F_OK)) return false; /* evicted under us */
+		skt_call_abort("Error copying file out of cache");
+	}
+	chmod(dest.c_str(),mode);
+	struct timeval tv[2];
+	tv[0].tv_sec=tv[1].tv_sec=mtime;
+	tv[0].tv_usec=tv[1].tv_usec=0;
+	utimes(dest.c_str(),tv);
+	return true;
+}
+
+int file_cache::evict(long maxAge)
+{
+	time_t old=time(NULL)-maxAge;
+	int nRemoved=0;
+	DIR *top=opendir(dir.c_str());
+	if (top==NULL) return 0;
+	struct dirent *t;
+	while ((t=readdir(top))!=NULL) {
+		if (t->d_name[0]=='.') continue;
+		std::string sub=dir+t->d_name;
+		struct stat st;
+		if (0!=lstat(sub.c_str(),&st)) continue;
+		if (!S_ISDIR(st.st_mode)) { /* leftover temporary file */
+			if (st.st_mtime<old && 0==unlink(sub.c_str())) nRemoved++;
+			continue;
+		}
+		DIR *d=opendir(sub.c_str());
+		if (d==NULL) continue;
+		struct dirent *e;
+		while ((e=readdir(d))!=NULL) {
+			if (e->d_name[0]=='.') continue;
+			std::string f=sub+"/"+e->d_name;
+			if (0==lstat(f.c_str(),&st) && st.st_mtime<old && 0==unlink(f.c_str()))
+				nRemoved++; /* jobs have their own copies */
+		}
+		closedir(d);
+	}
+	closedir(top);
+	return nRemoved;
+}
+
+file_cache::writer::writer(file_cache &c_,const osl::SHA256_hash_t &h_)
+	:c(c_),want(h_)
+{
+	tmp=c.temp_name();
+	fd=open(tmp.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0600);
+	if (fd<0) skt_call_abort("Error creating cache file");
+}
+
+file_cache::writer::~writer()
+{
+	if (fd>=0) { close(fd); unlink(tmp.c_str()); }
+}
+
+void file_cache::writer::add(const void *buf,int len)
+{
+	h.addBytes(buf,len);
+	const char *p=(const char *)buf;
+	while (len>0) {
+		int n=write(fd,p,len);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) skt_call_abort("Error writing cache file");
+		p+=n; len-=n;
+	}
+}
+
+void file_cache::writer::finish(void)
+{
+	osl::SHA256_hash_t got=h.end();
+	if (osl::SHA256_differ(&got,&want)) skt_call_abort("Security error: cache file doesn't match its hash!");
+	fchmod(fd,0444);
+	if (0!=close(fd)) skt_call_abort("Error writing cache file");
+	fd=-1;
+	std::string dest=c.path(want,false);
+	mkdir(dest.substr(0,dest.rfind('/')).c_str(),0700);
+	if (0!=rename(tmp.c_str(),dest.c_str())) skt_call_abort("Error renaming cache file");
+}
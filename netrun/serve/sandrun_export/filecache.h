@@ -0,0 +1,80 @@
+/* Content-addressed file cache, for project files that show up
+in job after job (Makefile.post, include/lib, the netrun scripts...).
+
+Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+*/
+#ifndef __FILECACHE_H
+#define __FILECACHE_H
+
+#include "osl/sha256.h"
+#include <string>
+
+/**
+ Files are stored read-only in <dir>/<xx>/<hash>, where <hash> is
+ the hex SHA-256 of their contents and <xx> its first two digits.
+ Executable files get a second copy, <hash>x, with execute permission.
+ A cache file's mtime is when it was last used, for eviction.
+
+ Any number of processes can share one cache: files are written
+ to a temporary name, checked, and renamed into place.
+*/
+class file_cache {
+public:
+	/* Use (and create, if needed) the cache in this directory,
+	   which ends in a slash. */
+	file_cache(const std::string &dir);
+
+	/* Return true if we have the file with this hash. */
+	bool has(const osl::SHA256_hash_t &h) const;
+
+	/* Make dest a copy of the cached file with this hash, with this
+	   mode and mtime: a reflink if the filesystem can, else a real
+	   copy, never a hard link (the job could change the cache file).
+	   Returns false if the file has left the cache (another worker 
+	   evicted it since has() said we had it). */
+	bool materialize(const osl::SHA256_hash_t &h,const std::string &dest,int mode,long mtime);
+
+	/* Remove cache files not used in the last maxAge seconds.
+	   Returns the number removed. */
+	int evict(long maxAge);
+
+	/* Convert hashes to and from hex strings */
+	static std::string hex(const osl::SHA256_hash_t &h);
+	static bool unhex(const char *str,osl::SHA256_hash_t &h);
+
+	/**
+	 Adds one file to the cache, as its bytes arrive.
+	*/
+	class writer {
+	public:
+		/* Start a file that should have this hash */
+		writer(file_cache &c,const osl::SHA256_hash_t &h);
+		~writer();
+		const osl::SHA256_hash_t &hash(void) const {return want;}
+		/* Add these next bytes of the file */
+		void add(const void *buf,int len);
+		/* Check the hash, and put the file in place.  Aborts if
+		  the contents don't match the hash. */
+		void finish(void);
+	private:
+		file_cache &c;
+		osl::SHA256_hash_t want;
+		osl::SHA256_hasher h;
+		std::string tmp; /* temporary file name */
+		int fd;
+	};
+
+private:
+	std::string dir;
+	/* Path to the cache file with this hash (and execute permission) */
+	std::string path(const osl::SHA256_hash_t &h,bool exec) const;
+	/* Return a fresh temporary file name in the cache */
+	std::string temp_name(void);
+	int nTemp;
+};
+
+/* Make dest a copy of src, by reflink if the filesystem can.
+  Returns false if it couldn't. */
+bool copy_file(const std::string &src,const std::string &dest,int mode);
+
+#endif
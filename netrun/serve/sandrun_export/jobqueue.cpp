@@ -0,0 +1,191 @@
+/* Admission control and fair-share job queue.
+
+Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+*/
+#include "jobqueue.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* Return a time in seconds */
+static double queue_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+1.0e-9*ts.tv_nsec;
+}
+
+job_queue::job_queue(int nSlots,int maxJobs,int userMax)
+{
+	size_t len=sizeof(board)+(maxJobs-1)*sizeof(entry);
+	void *m=mmap(0,len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if (m==MAP_FAILED) skt_call_abort("Error mapping job queue");
+	b=(board *)m; /* (mmap zeroes it, so every entry starts free) */
+	b->nSlots=nSlots;
+	b->maxJobs=maxJobs;
+	b->userMax=userMax;
+	b->seq=0;
+	b->avgRun=1.0;
+
+	pthread_mutexattr_t ma;
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma,PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&ma,PTHREAD_MUTEX_ROBUST); /* workers can die holding it */
+	pthread_mutex_init(&b->lock,&ma);
+	pthread_mutexattr_destroy(&ma);
+
+	pthread_condattr_t ca;
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca,PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&ca,CLOCK_MONOTONIC);
+	pthread_cond_init(&b->changed,&ca);
+	pthread_condattr_destroy(&ca);
+}
+
+void job_queue::lock(void)
+{
+	if (EOWNERDEAD==pthread_mutex_lock(&b->lock))
+		pthread_mutex_consistent(&b->lock); /* its jobs get dropped by cleanup */
+}
+
+void job_queue::unlock(void)
+{
+	pthread_mutex_unlock(&b->lock);
+}
+
+int job_queue::count(int state,const char *user) const
+{
+	int n=0;
+	for (int i=0;i<b->maxJobs;i++)
+		if (b->e[i].state==state && (user==0 || 0==strcmp(user,b->e[i].user)))
+			n++;
+	return n;
+}
+
+int job_queue::best_waiting(void) const
+{
+	int best=-1, bestRunning=0;
+	for (int i=0;i<b->maxJobs;i++) {
+		if (b->e[i].state!=job_waiting) continue;
+		int r=count(job_running,b->e[i].user);
+		if (best==-1 || r<bestRunning ||
+		   (r==bestRunning && (int)(b->e[i].seq-b->e[best].seq)<0))
+		{ best=i; bestRunning=r; }
+	}
+	return best;
+}
+
+bool job_queue::user_full(const char *user) const
+{
+	return count(job_admitted,user)+count(job_waiting,user)+count(job_running,user)>=b->userMax;
+}
+
+int job_queue::add(const char *user,state_t state)
+{
+	int t=-1;
+	for (int i=0;i<b->maxJobs;i++)
+		if (b->e[i].state==job_free) { t=i; break; }
+	if (t!=-1) {
+		entry &e=b->e[t];
+		e.pid=getpid();
+		e.state=state;
+		e.seq=b->seq++;
+		strncpy(e.user,user,sand_username_max);
+		e.user[sand_username_max]=0;
+	}
+	return t;
+}
+
+int job_queue::admit(const char *user,int *retryMs)
+{
+	lock();
+	int t=-1;
+	if (!user_full(user))
+		t=add(user,job_admitted);
+	/* Guess how long until the jobs ahead of them are done */
+	double wait=b->avgRun*(count(job_waiting)+1)/b->nSlots;
+	unlock();
+	int ms=(int)(1000*wait);
+	if (ms<100) ms=100;
+	if (ms>10000) ms=10000;
+	*retryMs=ms;
+	return t;
+}
+
+void job_queue::ready(int t)
+{
+	lock();
+	b->e[t].state=job_waiting;
+	b->e[t].seq=b->seq++; /* waiting starts now */
+	unlock();
+}
+
+int job_queue::enqueue(const char *user)
+{
+	lock();
+	int t=-1;
+	if (!user_full(user))
+		t=add(user,job_waiting);
+	unlock();
+	return t;
+}
+
+bool job_queue::start(int t)
+{
+	entry &e=b->e[t];
+	if (e.state==job_waiting && count(job_running)<b->nSlots && best_waiting()==t) {
+		e.state=job_running;
+		e.tStart=queue_time();
+	}
+	return e.state==job_running;
+}
+
+bool job_queue::try_start(int t)
+{
+	lock();
+	bool ret=start(t);
+	unlock();
+	return ret;
+}
+
+void job_queue::wait_start(int t)
+{
+	lock(); /* held from check to wait, so no wakeup slips past */
+	while (!start(t)) {
+		/* Time out now and then, in case a dead worker freed a slot */
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		ts.tv_nsec+=100*1000*1000;
+		if (ts.tv_nsec>=1000*1000*1000) { ts.tv_sec++; ts.tv_nsec-=1000*1000*1000; }
+		if (EOWNERDEAD==pthread_cond_timedwait(&b->changed,&b->lock,&ts))
+			pthread_mutex_consistent(&b->lock);
+	}
+	unlock();
+}
+
+void job_queue::release(int t)
+{
+	entry &e=b->e[t];
+	if (e.state==job_running) /* keep a running average of job times */
+		b->avgRun=0.8*b->avgRun+0.2*(queue_time()-e.tStart);
+	e.state=job_free;
+	pthread_cond_broadcast(&b->changed);
+}
+
+void job_queue::done(int t)
+{
+	lock();
+	release(t);
+	unlock();
+}
+
+void job_queue::cleanup(pid_t pid)
+{
+	lock();
+	for (int i=0;i<b->maxJobs;i++)
+		if (b->e[i].state!=job_free && b->e[i].pid==pid)
+			release(i);
+	unlock();
+}
@@ -0,0 +1,89 @@
+/* Admission control and fair-share scheduling of jobs onto
+execution slots, shared by all of sandserv's worker processes.
+
+Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+*/
+#ifndef __JOBQUEUE_H
+#define __JOBQUEUE_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "sandrun.h"
+
+/**
+ A scoreboard, in shared memory, of every job waiting for or
+ running on one of nSlots execution slots.  When a slot frees up,
+ it goes to the waiting job whose user has the fewest jobs running
+ (then to whoever has waited longest), so one user with many jobs
+ queued can't starve everybody else.
+
+ Each user can have at most userMax jobs waiting or running: past
+ that, new connections from that user are turned away as busy (old
+ clients just get an error), and further jobs on their open
+ connections wait outside the queue.
+*/
+class job_queue {
+public:
+	/* Make a queue for nSlots slots, with room for maxJobs jobs.
+	   Call before forking the workers, which all share it. */
+	job_queue(int nSlots,int maxJobs,int userMax);
+
+	/* Let in a new connection from this user, and hold a place in the
+	   queue for its first job.  Returns its ticket, or -1 if this user
+	   has too many jobs queued (or the queue is full), in which case
+	   retryMs is set to how long they should wait before trying again. */
+	int admit(const char *user,int *retryMs);
+
+	/* The job with this admitted ticket has arrived, and is ready to run. */
+	void ready(int ticket);
+
+	/* Add a waiting job for this user, ready to run.  Returns its ticket,
+	   or -1 if this user has too many jobs queued or the queue is full;
+	   try again later. */
+	int enqueue(const char *user);
+
+	/* Return true if this ticket has (or now gets) a slot to run in. */
+	bool try_start(int ticket);
+
+	/* Wait until this ticket gets a slot. */
+	void wait_start(int ticket);
+
+	/* This job is done with its slot (or done waiting for one). */
+	void done(int ticket);
+
+	/* This worker process died: drop all its jobs. */
+	void cleanup(pid_t pid);
+
+private:
+	typedef enum {
+		job_free=0, job_admitted, job_waiting, job_running
+	} state_t;
+	struct entry {
+		pid_t pid; /* worker process that owns this job */
+		int state; /* a state_t */
+		unsigned int seq; /* order of arrival */
+		double tStart; /* when it started running */
+		char user[sand_username_max+1];
+	};
+	struct board {
+		pthread_mutex_t lock; /* process-shared, robust */
+		pthread_cond_t changed; /* signaled when a slot frees up */
+		int nSlots, maxJobs, userMax;
+		unsigned int seq; /* next arrival number */
+		double avgRun; /* recent average seconds per job */
+		entry e[1]; /* really maxJobs long */
+	};
+	board *b;
+
+	void lock(void);
+	void unlock(void);
+	/* These need the lock held: */
+	int count(int state,const char *user=0) const;
+	bool user_full(const char *user) const;
+	int add(const char *user,state_t state);
+	int best_waiting(void) const;
+	bool start(int ticket);
+	void release(int ticket);
+};
+
+#endif
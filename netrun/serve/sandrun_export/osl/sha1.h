@@ -29,6 +29,10 @@ void SHA1_init(SHA1_word32 *state);
 /// Add this SHA1_data_words chunk of data to this SHA1_hash_words of state.
 void SHA1_transform(SHA1_word32 *state, const SHA1_word32 *data);
 
+/// Add these nblocks 64-byte chunks of (big-endian) bytes to this state.
+///  Uses the x86 SHA instructions if this CPU has them.
+void SHA1_transform_blocks(SHA1_word32 *state, const unsigned char *data, int nblocks);
+
 
 /************ Hash Stream Interface Code **********/
 /**
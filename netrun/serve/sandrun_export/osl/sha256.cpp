@@ -0,0 +1,352 @@
+/*************************************************************
+SHA-256 message hash and HMAC-SHA-256, in the style of osl/sha1.cpp.
+Input is hashed in 64-byte chunks; output is 8 32-bit native
+words (256 bits), considered big-endian when read as bytes.
+
+Whole chunks go through SHA256_transform_blocks, which uses the
+x86 SHA extensions on CPUs that support them, and a portable
+C version everywhere else.
+
+Public Domain.
+*/
+#include "osl/sha256.h"
+using namespace osl;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define SHA256_HAVE_SHANI 1 /* compiler can generate x86 SHA instructions */
+#  include <immintrin.h>
+#  include <cpuid.h>
+#endif
+
+static const SHA256_word32 SHA256_K[64]={
+	0x428a2f98u,0x71374491u,0xb5c0fbcfu,0xe9b5dba5u,0x3956c25bu,0x59f111f1u,0x923f82a4u,0xab1c5ed5u,
+	0xd807aa98u,0x12835b01u,0x243185beu,0x550c7dc3u,0x72be5d74u,0x80deb1feu,0x9bdc06a7u,0xc19bf174u,
+	0xe49b69c1u,0xefbe4786u,0x0fc19dc6u,0x240ca1ccu,0x2de92c6fu,0x4a7484aau,0x5cb0a9dcu,0x76f988dau,
+	0x983e5152u,0xa831c66du,0xb00327c8u,0xbf597fc7u,0xc6e00bf3u,0xd5a79147u,0x06ca6351u,0x14292967u,
+	0x27b70a85u,0x2e1b2138u,0x4d2c6dfcu,0x53380d13u,0x650a7354u,0x766a0abbu,0x81c2c92eu,0x92722c85u,
+	0xa2bfe8a1u,0xa81a664bu,0xc24b8b70u,0xc76c51a3u,0xd192e819u,0xd6990624u,0xf40e3585u,0x106aa070u,
+	0x19a4c116u,0x1e376c08u,0x2748774cu,0x34b0bcb5u,0x391c0cb3u,0x4ed8aa4au,0x5b9cca4fu,0x682e6ff3u,
+	0x748f82eeu,0x78a5636fu,0x84c87814u,0x8cc70208u,0x90befffau,0xa4506cebu,0xbef9a3f7u,0xc67178f2u
+};
+
+/// Initialize SHA256_hash_words of state.
+void osl::SHA256_init(SHA256_word32 *state)
+{
+	state[0] = 0x6a09e667u;
+	state[1] = 0xbb67ae85u;
+	state[2] = 0x3c6ef372u;
+	state[3] = 0xa54ff53au;
+	state[4] = 0x510e527fu;
+	state[5] = 0x9b05688cu;
+	state[6] = 0x1f83d9abu;
+	state[7] = 0x5be0cd19u;
+}
+
+/// Circular right shift in 32 bits
+inline SHA256_word32 rotr32(SHA256_word32 x, int y)
+{
+	return ((0xFFffFFffu)&(x>>y)) | ((0xFFffFFffu)&(x<<(32-y)));
+}
+
+/// Load a big-endian 32-bit word from these bytes
+inline SHA256_word32 loadBig32(const unsigned char *p)
+{
+	return (((SHA256_word32)p[0])<<24)|(((SHA256_word32)p[1])<<16)|(((SHA256_word32)p[2])<<8)|p[3];
+}
+
+/// Portable version of SHA256_transform_blocks
+static void SHA256_blocks_portable(SHA256_word32 *state, const unsigned char *data, int nblocks)
+{
+	SHA256_word32 W[64];
+	for (;nblocks>0;nblocks--,data+=SHA256_block_bytes) {
+		int t;
+		for (t=0;t<16;t++) W[t]=loadBig32(&data[4*t]);
+		for (t=16;t<64;t++) {
+			SHA256_word32 s0=rotr32(W[t-15],7)^rotr32(W[t-15],18)^(W[t-15]>>3);
+			SHA256_word32 s1=rotr32(W[t-2],17)^rotr32(W[t-2],19)^(W[t-2]>>10);
+			W[t]=0xFFffFFffu&(W[t-16]+s0+W[t-7]+s1);
+		}
+		/* Copy state to working vars */
+		SHA256_word32 a=state[0], b=state[1], c=state[2], d=state[3];
+		SHA256_word32 e=state[4], f=state[5], g=state[6], h=state[7];
+		for (t=0;t<64;t++) {
+			SHA256_word32 S1=rotr32(e,6)^rotr32(e,11)^rotr32(e,25);
+			SHA256_word32 ch=(e&f)^((~e)&g);
+			SHA256_word32 t1=h+S1+ch+SHA256_K[t]+W[t];
+			SHA256_word32 S0=rotr32(a,2)^rotr32(a,13)^rotr32(a,22);
+			SHA256_word32 maj=(a&b)^(a&c)^(b&c);
+			SHA256_word32 t2=S0+maj;
+			h=g; g=f; f=e; e=0xFFffFFffu&(d+t1);
+			d=c; c=b; b=a; a=0xFFffFFffu&(t1+t2);
+		}
+		/* Add the working vars back into state[] */
+		state[0]+=a; state[1]+=b; state[2]+=c; state[3]+=d;
+		state[4]+=e; state[5]+=f; state[6]+=g; state[7]+=h;
+	}
+}
+
+#if SHA256_HAVE_SHANI
+/* One group of 4 rounds using the SHA instructions.  MSG[i%4] holds
+  message words 4i..4i+3 (computed from the previous 4 groups for i>=4).
+*/
+#define SHA256NI_ROUNDS(i) \
+	if (i>=4) MSG[i%4]=_mm_sha256msg2_epu32(_mm_add_epi32( \
+		_mm_sha256msg1_epu32(MSG[i%4],MSG[(i+1)%4]), \
+		_mm_alignr_epi8(MSG[(i+3)%4],MSG[(i+2)%4],4)),MSG[(i+3)%4]); \
+	MSGK=_mm_add_epi32(MSG[i%4],_mm_loadu_si128((const __m128i *)&SHA256_K[4*i])); \
+	STATE1=_mm_sha256rnds2_epu32(STATE1,STATE0,MSGK); \
+	STATE0=_mm_sha256rnds2_epu32(STATE0,STATE1,_mm_shuffle_epi32(MSGK,0x0E));
+
+/// x86 SHA extensions version of SHA256_transform_blocks
+__attribute__((target("sha,ssse3,sse4.1")))
+static void SHA256_blocks_shani(SHA256_word32 *state, const unsigned char *data, int nblocks)
+{
+	const __m128i bswap=_mm_set_epi64x(0x0c0d0e0f08090a0bll,0x0405060700010203ll);
+	/* Shuffle state into the ABEF/CDGH order the instructions want */
+	__m128i TMP=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]),0xB1); /* CDAB */
+	__m128i STATE1=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]),0x1B); /* EFGH */
+	__m128i STATE0=_mm_alignr_epi8(TMP,STATE1,8); /* ABEF */
+	STATE1=_mm_blend_epi16(STATE1,TMP,0xF0); /* CDGH */
+	__m128i MSG[4], MSGK;
+	for (;nblocks>0;nblocks--,data+=SHA256_block_bytes) {
+		__m128i ABEF_save=STATE0, CDGH_save=STATE1;
+		for (int i=0;i<4;i++)
+			MSG[i]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+16*i)),bswap);
+		SHA256NI_ROUNDS( 0) SHA256NI_ROUNDS( 1) SHA256NI_ROUNDS( 2) SHA256NI_ROUNDS( 3)
+		SHA256NI_ROUNDS( 4) SHA256NI_ROUNDS( 5) SHA256NI_ROUNDS( 6) SHA256NI_ROUNDS( 7)
+		SHA256NI_ROUNDS( 8) SHA256NI_ROUNDS( 9) SHA256NI_ROUNDS(10) SHA256NI_ROUNDS(11)
+		SHA256NI_ROUNDS(12) SHA256NI_ROUNDS(13) SHA256NI_ROUNDS(14) SHA256NI_ROUNDS(15)
+		STATE0=_mm_add_epi32(STATE0,ABEF_save);
+		STATE1=_mm_add_epi32(STATE1,CDGH_save);
+	}
+	/* Shuffle back to ABCD/EFGH */
+	TMP=_mm_shuffle_epi32(STATE0,0x1B); /* FEBA */
+	STATE1=_mm_shuffle_epi32(STATE1,0xB1); /* DCHG */
+	_mm_storeu_si128((__m128i *)&state[0],_mm_blend_epi16(TMP,STATE1,0xF0)); /* DCBA */
+	_mm_storeu_si128((__m128i *)&state[4],_mm_alignr_epi8(STATE1,TMP,8)); /* HGFE */
+}
+
+/// Return true if this CPU supports the SHA instructions we use.
+static bool SHA256_cpu_has_shani(void)
+{
+	unsigned int a,b,c,d;
+	if (!__get_cpuid(1,&a,&b,&c,&d)) return false;
+	if (!(c&bit_SSSE3) || !(c&bit_SSE4_1)) return false;
+	if (!__get_cpuid_count(7,0,&a,&b,&c,&d)) return false;
+	return (b&(1u<<29))!=0; /* CPUID.7.0:EBX.SHA */
+}
+#endif
+
+typedef void (*SHA256_blocks_fn)(SHA256_word32 *state, const unsigned char *data, int nblocks);
+
+/// Pick the fastest SHA256_transform_blocks this machine can run.
+static SHA256_blocks_fn SHA256_pick_blocks(void)
+{
+#if SHA256_HAVE_SHANI
+	if (SHA256_cpu_has_shani()) return SHA256_blocks_shani;
+#endif
+	return SHA256_blocks_portable;
+}
+
+void osl::SHA256_transform_blocks(SHA256_word32 *state, const unsigned char *data, int nblocks)
+{
+	static const SHA256_blocks_fn fn=SHA256_pick_blocks();
+	fn(state,data,nblocks);
+}
+
+
+void osl::SHA256_hasher::init(void) {
+	SHA256_init(state);
+	bytes=0; b=0;
+}
+void osl::SHA256_hasher::addBytes(const void *p,int l)
+{
+	const unsigned char *ptr=(const unsigned char *)p;
+	if (l<=0) return;
+	bytes+=l;
+	/* Top off any partial chunk */
+	if (b>0) {
+		int n=SHA256_block_bytes-b;
+		if (n>l) n=l;
+		memcpy(&buf[b],ptr,n);
+		b+=n; ptr+=n; l-=n;
+		if (b<SHA256_block_bytes) return;
+		SHA256_transform_blocks(state,buf,1);
+		b=0;
+	}
+	/* Hash whole chunks straight out of the caller's buffer */
+	int nblocks=l/SHA256_block_bytes;
+	if (nblocks>0) {
+		SHA256_transform_blocks(state,ptr,nblocks);
+		ptr+=nblocks*SHA256_block_bytes; l-=nblocks*SHA256_block_bytes;
+	}
+	/* Save leftovers for next time */
+	memcpy(buf,ptr,l);
+	b=l;
+}
+SHA256_hash_t osl::SHA256_hasher::end(void)
+{
+	SHA256_hash_t ret;
+	unsigned long long totBits=bytes*8;
+
+	/* Paste on the end-of-message and length fields */
+	buf[b++]=0x80u; /*End-of-message: one followed by zeros*/
+	if (b>SHA256_block_bytes-8) { /* no room for length in this chunk */
+		memset(&buf[b],0,SHA256_block_bytes-b);
+		SHA256_transform_blocks(state,buf,1);
+		b=0;
+	}
+	memset(&buf[b],0,SHA256_block_bytes-8-b);
+	for (int i=0;i<8;i++) buf[SHA256_block_bytes-1-i]=0xffu & (totBits>>(8*i));
+	SHA256_transform_blocks(state,buf,1);
+
+	/*Convert the result from words back to bytes*/
+	for (int i=0;i<SHA256_hash_words;i++) {
+		ret.data[i*4+0]=0xffu & (state[i]>>24);
+		ret.data[i*4+1]=0xffu & (state[i]>>16);
+		ret.data[i*4+2]=0xffu & (state[i]>> 8);
+		ret.data[i*4+3]=0xffu & (state[i]>> 0);
+	}
+
+	/* Prepare for next run round */
+	init();
+	return ret;
+}
+
+
+osl::HMAC_SHA256::HMAC_SHA256(const void *key,int keyLen)
+{
+	unsigned char k[SHA256_block_bytes]={0}, pad[SHA256_block_bytes];
+	if (keyLen>SHA256_block_bytes) { /* long keys get hashed first */
+		SHA256_hash_t hk=SHA256_hash(key,keyLen);
+		memcpy(k,hk.data,sizeof(hk));
+	}
+	else memcpy(k,key,keyLen);
+
+	for (int i=0;i<SHA256_block_bytes;i++) pad[i]=k[i]^0x36;
+	inner.addBytes(pad,sizeof(pad));
+	for (int i=0;i<SHA256_block_bytes;i++) pad[i]=k[i]^0x5c;
+	outer.addBytes(pad,sizeof(pad));
+}
+
+SHA256_hash_t osl::HMAC_SHA256::end(SHA256_hasher &h) const
+{
+	SHA256_hash_t ih=h.end();
+	SHA256_hasher o=outer;
+	o.addBytes(ih.data,sizeof(ih));
+	return o.end();
+}
+
+
+#if SHA256_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "osl/sha1.h"
+/* Checks against published test vectors, then compares the per-message
+  cost of auth_pipe's original SHA-1 construction (nonces, count, secret,
+  data) against HMAC-SHA-256 over (nonces, count, data).
+  Build with "make mac_bench".
+*/
+static double mac_walltime(void) {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return tv.tv_sec+0.000001*tv.tv_usec;
+}
+
+static int check_hex(const char *what,const SHA256_hash_t &h,const char *hex) {
+	char out[2*sizeof(h)+1];
+	for (unsigned int i=0;i<sizeof(h);i++) sprintf(&out[2*i],"%02x",h.data[i]);
+	int bad=0!=strcmp(out,hex);
+	printf("  %-24s %s\n",what,bad?"MISMATCH!":"OK");
+	return bad;
+}
+
+int main(int argc,char *argv[])
+{
+	int bad=0;
+	printf("SHA-256: %s\n",
+#if SHA256_HAVE_SHANI
+		SHA256_cpu_has_shani()?"using SHA-NI":"no SHA-NI"
+#else
+		"portable only"
+#endif
+		);
+	bad+=check_hex("SHA-256(\"abc\")",SHA256_hash("abc",3),
+		"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	const char *two="abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	bad+=check_hex("SHA-256(2 chunks)",SHA256_hash(two,strlen(two)),
+		"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+	HMAC_SHA256 jefe("Jefe",4);
+	SHA256_hasher h=jefe.start();
+	const char *msg="what do ya want for nothing?";
+	h.addBytes(msg,strlen(msg));
+	bad+=check_hex("HMAC (RFC 4231 case 2)",jefe.end(h),
+		"5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+
+	/* Fast path vs portable path, for odd lengths and splits */
+	int maxlen=10*1024*1024;
+	unsigned char *buf=(unsigned char *)malloc(maxlen);
+	for (int i=0;i<maxlen;i++) buf[i]=(unsigned char)(i*7+(i>>8));
+	int mismatch=0;
+	for (int l=0;l<300;l+=7)
+	for (int split=0;split<=l;split+=13) {
+		SHA256_hasher s;
+		s.addBytes(buf+1,split);
+		s.addBytes(buf+1+split,l-split);
+		SHA256_hash_t a=s.end();
+
+		SHA256_word32 state[SHA256_hash_words];
+		unsigned char tail[2*SHA256_block_bytes]={0};
+		int whole=l/SHA256_block_bytes, rest=l%SHA256_block_bytes;
+		int nb=(rest+1+8>SHA256_block_bytes)?2:1;
+		SHA256_init(state);
+		SHA256_blocks_portable(state,buf+1,whole);
+		memcpy(tail,buf+1+whole*SHA256_block_bytes,rest);
+		tail[rest]=0x80;
+		unsigned long long bits=8ull*l;
+		for (int i=0;i<8;i++) tail[nb*SHA256_block_bytes-1-i]=0xff&(bits>>(8*i));
+		SHA256_blocks_portable(state,tail,nb);
+		for (int i=0;i<SHA256_hash_words;i++)
+			if (loadBig32(&a.data[4*i])!=state[i]) {mismatch++; break;}
+	}
+	printf("  %-24s %d mismatches\n","dispatched vs portable",mismatch);
+	bad+=mismatch;
+
+	/* Per-message MAC cost */
+	unsigned char nonces[32]={0}, count[4]={0};
+	const char *secret="THIS_IS_NOT_MUCH_OF_A_SECRET_MAN";
+	HMAC_SHA256 hmac(secret,strlen(secret));
+	int sizes[3]={1024,64*1024,10*1024*1024};
+	printf("Per-message MAC cost:\n");
+	for (int s=0;s<3;s++) {
+		int len=sizes[s], reps=(64*1024*1024)/len;
+		if (reps<4) reps=4;
+
+		double t=mac_walltime();
+		for (int r=0;r<reps;r++) {
+			osl::SHA1_hasher h1;
+			h1.addBytes(nonces,sizeof(nonces));
+			h1.addBytes(count,sizeof(count));
+			h1.addBytes(secret,strlen(secret));
+			h1.addBytes(buf,len);
+			h1.end();
+		}
+		double t1=(mac_walltime()-t)/reps;
+
+		t=mac_walltime();
+		for (int r=0;r<reps;r++) {
+			SHA256_hasher h2=hmac.start();
+			h2.addBytes(nonces,sizeof(nonces));
+			h2.addBytes(count,sizeof(count));
+			h2.addBytes(buf,len);
+			hmac.end(h2);
+		}
+		double t2=(mac_walltime()-t)/reps;
+		printf("  %8d bytes:  SHA-1 %10.2f us/msg   HMAC-SHA-256 %10.2f us/msg\n",
+			len,t1*1.0e6,t2*1.0e6);
+	}
+	free(buf);
+	return bad!=0;
+}
+#endif
@@ -0,0 +1,95 @@
+/*
+SHA-256 (Secure Hash Algorithm-2, 256 bits), as described in
+the NIST publication FIPS PUB 180-2, and HMAC-SHA-256 (RFC 2104).
+
+Same interface as osl/sha1.h (Public Domain)
+*/
+#ifndef __OSL_SHA256_H
+#define __OSL_SHA256_H
+
+#include <string.h> /* for memcmp */
+
+namespace osl {
+
+/********** Hash Basics (per chunk) ***********/
+/** The output of the SHA-256 hash algorithm: 32 bytes. */
+typedef struct {
+	unsigned char data[32];
+} SHA256_hash_t;
+
+enum {SHA256_block_bytes=64}; /*Length of each chunk of input data (bytes)*/
+enum {SHA256_hash_words=8}; /*Length of output hash code (words)*/
+
+/*Contains at least the low 32 bits of a big-endian integer.*/
+typedef unsigned int SHA256_word32;
+
+/// Initialize SHA256_hash_words of state.
+void SHA256_init(SHA256_word32 *state);
+
+/// Add these nblocks 64-byte chunks of (big-endian) bytes to this state.
+///  Uses the x86 SHA instructions if this CPU has them.
+void SHA256_transform_blocks(SHA256_word32 *state, const unsigned char *data, int nblocks);
+
+
+/************ Hash Stream Interface Code **********/
+/**
+  Computes a SHA-256 hash code on streamed input of
+  arbitrary length.  Can be copied, to hash several
+  messages that start with the same bytes.
+*/
+class SHA256_hasher {
+	SHA256_word32 state[SHA256_hash_words];
+	unsigned long long bytes; /**< message length accumulator */
+
+	unsigned char buf[SHA256_block_bytes]; /* partial chunk */
+	int b; /* bytes of buf that have not been transformed */
+public:
+	SHA256_hasher() {init();}
+	void init(void);
+
+	/// Add these bytes to this message.
+	///  Can be called repeatedly to assemble a long message.
+	void addBytes(const void *p,int l);
+
+	/// End the message and extract the hash code.
+	/// Resets the hasher for a new message.
+	SHA256_hash_t end(void);
+};
+
+inline SHA256_hash_t SHA256_hash(const void *p,int l) {
+	SHA256_hasher h;
+	h.addBytes(p,l);
+	return h.end();
+}
+
+/*Compare two hashed values-- return 1 if they differ; 0 else
+ */
+inline int SHA256_differ(const SHA256_hash_t *a,const SHA256_hash_t *b)
+{
+  return 0!=memcmp(a->data,b->data,sizeof(SHA256_hash_t));
+}
+
+
+/************ HMAC-SHA-256 **********/
+/**
+  Computes HMAC-SHA-256 message authentication codes
+  for one fixed key.  The keyed inner and outer hash states
+  are computed once up front, so each message only costs
+  hashing its own bytes plus two more chunks.
+*/
+class HMAC_SHA256 {
+	SHA256_hasher inner; /* after hashing key^ipad */
+	SHA256_hasher outer; /* after hashing key^opad */
+public:
+	HMAC_SHA256(const void *key,int keyLen);
+
+	/// Start a new message: add its bytes to the returned hasher.
+	SHA256_hasher start(void) const {return inner;}
+
+	/// Finish a message started above, and return its MAC.
+	SHA256_hash_t end(SHA256_hasher &h) const;
+};
+
+};
+
+#endif
@@ -0,0 +1,108 @@
+/* Protocol shared by sandsend (client) and sandserv (server).
+
+Conversation, all over an auth_pipe:
+	client: sand_head_t (version and username)
+	server: "OK" reply.  Clients with minor version 1 or higher
+		get "OK" followed by the Big32 version both sides will use.
+		Clients with minor 6 or higher may instead get "BZ" followed
+		by a Big32 number of milliseconds: the server is too busy,
+		so hang up and try again after that long.
+	client: tar file (as a chunked message, for minor 2 or higher)
+	server: program output messages, ending with a zero-length message
+	server: Big32 make result code
+
+With minor 3 or higher, after the OK reply the connection switches to
+duplex mode (see auth_pipe::set_duplex), and carries any number of jobs.
+Every message then starts with a sand_tag_t saying which job it's for:
+	client: sand_msg_tar pieces of a job's tar file (chunked; pieces
+		of one job's tar file can't be mixed with another job's)
+	server: sand_msg_output program output, any time after that
+	server: sand_msg_result Big32 make result code, ending the job
+	client: sand_msg_close once it has no more jobs to send.
+		The server finishes the jobs it has, then hangs up.
+The client can keep sending jobs while earlier ones run; results 
+come back in whatever order the jobs finish.  The client may have at
+most sand_mux_jobs_max jobs sent but not yet finished; the server hangs
+up on clients that send more.  The server always keeps reading, and 
+never waits to send, so a client can send a whole job before reading.
+
+With minor 4 or higher, a client can send a job as a manifest of 
+file hashes instead of a tar file, and only upload the files the
+server hasn't already cached (see filecache.h):
+	client: sand_msg_manifest pieces (chunked), of lines like
+		"f <hex SHA-256> <octal mode> <mtime> <path>" for files, and
+		"d <octal mode> <path>" for directories.
+	server: sand_msg_need with the 32-byte hashes it doesn't have
+		(maybe none), and hasn't already asked this client for.
+	client: sand_msg_file for each, as a 32-byte hash then the data
+		(chunked; every piece starts with the hash).
+The job runs once all its files have arrived.  If files leave the
+server's cache before the job's run directory is built, the server
+sends another sand_msg_need for them, any time before the result.
+
+With minor 5 or higher, just before each job's result, the server 
+sends a sand_msg_trailer of text lines like "<key> <values...>":
+	"phase <name> <microseconds>" for each phase of the job:
+		receive, unpack, wait, make, send, and cleanup from the server,
+		and compile, link, run, grade... from the netrun scripts.
+	"usage <key>=<value> ..." for each program run in the sandbox,
+		with its exit status, signal, wall and CPU time, max RSS,
+		page faults, and context switches (see s4g_chroot).
+	"result <json>" for each timing the program's harness recorded
+		(see NETRUN_RESULTS in include/lib/inc.c), one JSON object 
+		per line.
+Clients should ignore keys they don't know.
+
+The version is major<<16 | minor.  The major version only
+changes on incompatible changes; each new minor version adds
+a feature, and both sides use the lower of their two minors.
+
+Public Domain.
+*/
+#ifndef __SANDRUN_H
+#define __SANDRUN_H
+
+#include "sockRoutines.h"
+
+enum {
+	sand_major=1, /* incompatible protocol changes */
+	sand_minor_sha1=0, /* original protocol, with SHA-1 message auth */
+	sand_minor_hmac=1, /* HMAC-SHA-256 message auth after the OK reply */
+	sand_minor_chunked=2, /* chunked messages after the OK reply */
+	sand_minor_mux=3, /* many tagged jobs per connection */
+	sand_minor_cache=4, /* manifest jobs, with server-side file cache */
+	sand_minor_timing=5, /* trailer with per-phase timing */
+	sand_minor_busy=6, /* "BZ" busy reply instead of "OK" */
+	sand_minor=6 /* latest minor version we speak */
+};
+#define sand_version(major,minor) (((major)<<16)|(minor))
+#define sand_version_minor(v) ((v)&0xffff)
+
+enum {sand_username_max=31}; /* longest username, not counting the nul */
+enum {sand_mux_jobs_max=64}; /* most unfinished jobs per mux connection */
+
+/* Header sent by the client to start a request */
+struct sand_head_t {
+	Big32 version; /* Version number of request */
+	char username[sand_username_max+1]; /* nul-terminated username string */
+};
+
+/* Message types in mux mode */
+enum {
+	sand_msg_tar=1, /* client: piece of the job's tar file */
+	sand_msg_close=2, /* client: no more jobs coming */
+	sand_msg_output=3, /* server: some program output */
+	sand_msg_result=4, /* server: Big32 make result code; job is done */
+	sand_msg_manifest=5, /* client: piece of the job's manifest */
+	sand_msg_need=6, /* server: hashes of files to send */
+	sand_msg_file=7, /* client: piece of a file the server needs */
+	sand_msg_trailer=8 /* server: text lines about the job, before the result */
+};
+
+/* Starts every message in mux mode */
+struct sand_tag_t {
+	Big32 job; /* job ID, picked by the client */
+	Big32 type; /* a sand_msg_ type */
+};
+
+#endif
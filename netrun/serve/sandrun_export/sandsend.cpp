@@ -9,13 +9,44 @@ Receives back from the server:
 	- Program output text
 	- Make result code
 
+With -d, sends a project directory as a manifest of file hashes,
+and only uploads the files the server doesn't already have cached.
+Old servers can't do this, so also pass -f with a tar of the same
+directory to use with them.
+
+With -b, reads lines of "<tar> [<output>]" from stdin instead,
+and sends each as a separate job over the one connection, without
+waiting for earlier jobs to finish.  Prints "job <n> result <r> <tar>"
+as each job finishes (in whatever order that is).  Each job's output 
+goes to <output>, or <tar>.out by default.  The <tar> can also
+be a project directory, sent as with -d.
+
+With -t, shows the server's "phase <name> <microseconds>" timing 
+lines for each job (on stderr, or labeled "job <n>" on stdout in
+batch mode), plus the whole round trip as "client_total", and
+the "usage ..." resource accounting of each sandboxed run.  
+
+With -r, appends the JSON timing results each job's program recorded 
+(from the server's "result" trailer lines) to this file, one per line.
+Exits with the number of jobs that failed.
+
 Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <string>
+#include <map>
+#include <dirent.h>
 #include "auth_pipe.h"
+#include "filecache.h"
+#include "sandrun.h"
 #include "config.h"
 
 #define BLOCK 65536
@@ -27,8 +58,12 @@ void quit(const char *why) {
 
 void usage(const char *why) {
 	fprintf(stdout,
-	 "Usage: sandsend [ -f <tar> ] [ -o <output> ] [ -u <username> ] <host>:<port>\n"
-	 "  Send this tar file to this host and port. \n");
+	 "Usage: sandsend [ -f <tar> ] [ -d <dir> ] [ -o <output> ] [ -u <username> ] [ -t ] [ -r <results> ] <host>:<port>\n"
+	 "  Send this tar file (or project directory) to this host and port. \n"
+	 "   or: sandsend -b [ -u <username> ] [ -t ] [ -r <results> ] <host>:<port>\n"
+	 "  Send each tar file listed on stdin, all over one connection.\n"
+	 "  -t shows how long each phase of the job took, in microseconds.\n"
+	 "  -r <file> appends the job's JSON timing results to this file.\n");
 	quit(why);
 }
 
@@ -57,12 +92,349 @@ static int my_skt_abort(int code,const char *msg)
   return -1;
 }
 
+/* A job we've sent over a mux connection */
+struct client_job {
+	std::string tarName;
+	FILE *out; /* where its output goes */
+	std::map<std::string,std::string> files; /* manifest job: path by hash */
+	double tSubmit; /* walltime when we started sending it */
+	client_job() :out(0),tSubmit(walltime()) {}
+};
+std::map<int,client_job> jobs; /* jobs still running, by ID */
+int batch=0; /* -b: read jobs from stdin */
+int timing=0; /* -t: show where the time went */
+FILE *results=0; /* -r: where JSON timing results go */
+int failures=0; /* jobs that came back nonzero */
+int version=0; /* protocol version we agreed on */
+
+/* Send off this tar file as mux job id.  Returns false if we can't read it. */
+bool send_job(auth_pipe &p,int id,const char *tarName)
+{
+	int fd=open(tarName,O_RDONLY);
+	struct stat st;
+	if (fd<0 || 0!=fstat(fd,&st)) {
+		if (fd>=0) close(fd);
+		return false;
+	}
+	const char *tar="";
+	if (st.st_size>0) {
+		void *m=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+		if (m==MAP_FAILED) { close(fd); return false; }
+		tar=(const char *)m;
+	}
+	status("Sending tar file");
+	sand_tag_t tag;
+	tag.job=id; tag.type=sand_msg_tar;
+	long len=st.st_size, off=0;
+	do {
+		int n=(len-off>auth_pipe::chunk_max)?auth_pipe::chunk_max:len-off;
+		const void *bufs[2]={&tag,tar+off};
+		int lens[2]={sizeof(tag),n};
+		off+=n;
+		p.send_pieceV(2,bufs,lens,off<len);
+	} while (off<len);
+	if (st.st_size>0) munmap((void *)tar,st.st_size);
+	close(fd);
+	return true;
+}
+
+/* Send this file's contents as the file with hash h */
+void send_file(auth_pipe &p,int id,const std::string &key,const std::string &path)
+{
+	int fd=open(path.c_str(),O_RDONLY);
+	struct stat st;
+	if (fd<0 || 0!=fstat(fd,&st)) quit("Can't read project file");
+	const char *data="";
+	if (st.st_size>0) {
+		void *m=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+		if (m==MAP_FAILED) quit("Can't map project file");
+		data=(const char *)m;
+	}
+	sand_tag_t tag;
+	tag.job=id; tag.type=sand_msg_file;
+	long len=st.st_size, off=0;
+	do {
+		int n=(len-off>auth_pipe::chunk_max)?auth_pipe::chunk_max:len-off;
+		const void *bufs[3]={&tag,key.data(),data+off};
+		int lens[3]={sizeof(tag),(int)key.size(),n};
+		off+=n;
+		p.send_pieceV(3,bufs,lens,off<len);
+	} while (off<len);
+	if (st.st_size>0) munmap((void *)data,st.st_size);
+	close(fd);
+}
+
+/* Add everything under dir+rel to this manifest, hashing each file */
+void walk_dir(const std::string &dir,const std::string &rel,std::string &manifest,client_job &j)
+{
+	DIR *d=opendir((dir+rel).c_str());
+	if (d==NULL) return;
+	struct dirent *e;
+	while ((e=readdir(d))!=NULL) {
+		std::string name=e->d_name;
+		if (name=="." || name==".." || name.find('\n')!=std::string::npos) continue;
+		std::string path=dir+rel+name;
+		struct stat st;
+		if (0!=lstat(path.c_str(),&st)) continue;
+		char line[100];
+		if (S_ISDIR(st.st_mode)) {
+			sprintf(line,"d %o ",(int)(st.st_mode&0777));
+			manifest+=line+rel+name+"\n";
+			walk_dir(dir,rel+name+"/",manifest,j);
+		}
+		else if (S_ISREG(st.st_mode)) { /* links and such are skipped */
+			FILE *f=fopen(path.c_str(),"rb");
+			if (f==NULL) continue;
+			osl::SHA256_hasher h;
+			char buf[65536];
+			int n;
+			while ((n=fread(buf,1,sizeof(buf),f))>0) h.addBytes(buf,n);
+			fclose(f);
+			osl::SHA256_hash_t hc=h.end();
+			sprintf(line," %o %ld ",(int)(st.st_mode&0777),(long)st.st_mtime);
+			manifest+="f "+file_cache::hex(hc)+line+rel+name+"\n";
+			j.files[std::string((const char *)hc.data,sizeof(hc.data))]=path;
+		}
+	}
+	closedir(d);
+}
+
+/* Send off this project directory's manifest as mux job id. */
+void send_manifest(auth_pipe &p,int id,const char *dirName,client_job &j)
+{
+	status("Sending manifest");
+	std::string manifest;
+	walk_dir(std::string(dirName)+"/","",manifest,j);
+	sand_tag_t tag;
+	tag.job=id; tag.type=sand_msg_manifest;
+	long len=manifest.size(), off=0;
+	do {
+		int n=(len-off>auth_pipe::chunk_max)?auth_pipe::chunk_max:len-off;
+		const void *bufs[2]={&tag,manifest.data()+off};
+		int lens[2]={sizeof(tag),n};
+		off+=n;
+		p.send_pieceV(2,bufs,lens,off<len);
+	} while (off<len);
+}
+
+/* Return true if this is a directory */
+bool is_dir(const char *path)
+{
+	struct stat st;
+	return 0==stat(path,&st) && S_ISDIR(st.st_mode);
+}
+
+/* Show these timing lines for this job: in batch mode on stdout,
+  labeled by job, else on stderr (to keep them out of the output). */
+void timing_line(int id,const std::string &lines)
+{
+	std::string::size_type at=0, nl;
+	while ((nl=lines.find('\n',at))!=std::string::npos) {
+		std::string line=lines.substr(at,nl-at);
+		at=nl+1;
+		if (batch) fprintf(stdout,"job %d %s\n",id,line.c_str());
+		else fprintf(stderr,"%s\n",line.c_str());
+	}
+}
+
+/* Save any "result <json>" lines from this trailer */
+void result_lines(const std::string &lines)
+{
+	std::string::size_type at=0, nl;
+	while ((nl=lines.find('\n',at))!=std::string::npos) {
+		if (0==lines.compare(at,7,"result "))
+			fprintf(results,"%s\n",lines.substr(at+7,nl-at-7).c_str());
+		at=nl+1;
+	}
+	fflush(results);
+}
+
+/* Receive one tagged message from the server */
+void recv_job_msg(auth_pipe &p)
+{
+	status("Receiving program output");
+	int len=p.recv_start();
+	sand_tag_t tag;
+	if (len<(int)sizeof(tag)) quit("Message from server too short!");
+	p.recv(&tag,sizeof(tag));
+	len-=sizeof(tag);
+	std::map<int,client_job>::iterator it=jobs.find(tag.job);
+	if (it==jobs.end()) quit("Server sent message for unknown job!");
+	client_job &j=it->second;
+	if ((int)tag.type==sand_msg_output) {
+		fwrite(p.recv(len),len,1,j.out);
+		fflush(j.out); /* show output as soon as it arrives */
+	}
+	else if ((int)tag.type==sand_msg_need) { /* send the files it asked for */
+		std::string keys((const char *)p.recv(len),len);
+		p.recv_done(); /* before we start sending */
+		if (len>0) status("Sending project files");
+		int hlen=sizeof(osl::SHA256_hash_t);
+		for (int i=0;i+hlen<=len;i+=hlen) {
+			std::map<std::string,std::string>::iterator f=j.files.find(keys.substr(i,hlen));
+			if (f==j.files.end()) quit("Server asked for a file we didn't list!");
+			send_file(p,tag.job,f->first,f->second);
+		}
+		return; /* (it can ask again, if it loses them) */
+	}
+	else if ((int)tag.type==sand_msg_trailer) {
+		std::string lines((const char *)p.recv(len),len);
+		if (timing) timing_line(tag.job,lines);
+		if (results) result_lines(lines);
+	}
+	else if ((int)tag.type==sand_msg_result) {
+		Big32 r;
+		if (len!=sizeof(r)) quit("Bad result message from server!");
+		p.recv(&r,sizeof(r));
+		if ((int)r!=0) failures++;
+		if (timing) { /* whole round trip, as we saw it */
+			char line[100];
+			sprintf(line,"phase client_total %ld\n",(long)((walltime()-j.tSubmit)*1.0e6));
+			timing_line(tag.job,line);
+		}
+		if (batch) {
+			fclose(j.out);
+			fprintf(stdout,"job %d result %d %s\n",(int)tag.job,(int)r,j.tarName.c_str());
+			fflush(stdout);
+		}
+		else failures=r; /* single job: return its result code */
+		jobs.erase(it);
+	}
+	else quit("Unknown message type from server!");
+	p.recv_done();
+}
+
+/* Start jobs for the whole lines in lines, removing them, until
+  there are sand_mux_jobs_max jobs out at once. */
+void start_jobs(auth_pipe &p,std::string &lines,int &nextID)
+{
+	std::string::size_type nl;
+	while (jobs.size()<sand_mux_jobs_max && (nl=lines.find('\n'))!=std::string::npos) {
+		std::string line=lines.substr(0,nl);
+		lines.erase(0,nl+1);
+		char tarName[1024], outName[1024];
+		int nf=sscanf(line.c_str(),"%1023s %1023s",tarName,outName);
+		if (nf<1) continue; /* blank line */
+		if (nf<2) sprintf(outName,"%.1000s.out",tarName);
+		client_job j;
+		j.tarName=tarName;
+		j.out=fopen(outName,"w");
+		if (j.out==NULL) {
+			fprintf(stdout,"job %d error: can't create output file %s\n",nextID++,outName);
+			failures++;
+			continue;
+		}
+		if (is_dir(tarName)) {
+			if (sand_version_minor(version)<sand_minor_cache) {
+				fclose(j.out);
+				fprintf(stdout,"job %d error: server is too old for directory %s\n",nextID++,tarName);
+				failures++;
+				continue;
+			}
+			jobs[nextID]=j;
+			send_manifest(p,nextID,tarName,jobs[nextID]);
+			nextID++;
+			continue;
+		}
+		if (!send_job(p,nextID,tarName)) {
+			fclose(j.out);
+			fprintf(stdout,"job %d error: can't read tar file %s\n",nextID++,tarName);
+			failures++;
+			continue;
+		}
+		jobs[nextID++]=j;
+	}
+	fflush(stdout);
+}
+
+/* Batch mode: send off each job listed on stdin as soon as it's listed
+  (keeping at most sand_mux_jobs_max out at once), while receiving 
+  output and results for earlier jobs. */
+void run_batch(auth_pipe &p,SOCKET s)
+{
+	std::string lines; /* stdin not yet made into jobs */
+	bool stdinDone=false, closed=false;
+	int nextID=1;
+	while (!closed || !jobs.empty()) {
+		bool room=jobs.size()<sand_mux_jobs_max;
+		struct pollfd fds[2]={{s,POLLIN,0},{0,POLLIN,0}};
+		if (poll(fds,(!stdinDone && room)?2:1,-1)<0) {
+			if (errno==EINTR) continue;
+			quit("Error polling");
+		}
+		if (fds[0].revents) recv_job_msg(p);
+		if (!stdinDone && room && fds[1].revents) {
+			char buf[1024];
+			int n=read(0,buf,sizeof(buf));
+			if (n<0 && errno==EINTR) continue;
+			if (n>0) lines.append(buf,n);
+			else { /* finish any last line without a newline */
+				stdinDone=true;
+				if (lines.size()>0) lines+="\n";
+			}
+		}
+		start_jobs(p,lines,nextID);
+		if (stdinDone && !closed && lines.find('\n')==std::string::npos) {
+			sand_tag_t tag; /* no more jobs coming */
+			tag.job=0; tag.type=sand_msg_close;
+			p.send_msg(&tag,sizeof(tag));
+			closed=true;
+		}
+	}
+}
+
+/* Connect and introduce ourselves to the server, coming back later
+  if it says it's busy.  Sets version to the version we agreed on. */
+auth_pipe *server_connect(skt_ip_t ip,unsigned int port,const char *userName,SOCKET *s)
+{
+	enum {busy_max_tries=100}; /* "busy" replies before we give up */
+	for (int tries=0;;tries++) {
+		status("Connecting");
+		*s=skt_connect(ip,port,10);
+		status("Authenticating");
+		auth_pipe *p=new auth_pipe(MY_SHARED_SECRET,auth_pipe::dir_B,*s);
+		
+		/* Send off version number and username */
+		status("Sending version and username");
+		struct sand_head_t sh;
+		sh.version=sand_version(sand_major,sand_minor);
+		strcpy(sh.username,userName);
+		p->send_msg(&sh,sizeof(sh));
+		
+		/* Want 2-byte "OK" string, possibly followed by the agreed version */
+		enum {repl_len=2};
+		int len=p->recv_start();
+		if (len<repl_len) quit("Didn't get OK response!\n");
+		const char *repl=(const char *)p->recv(repl_len);
+		if (0==strncmp(repl,"BZ",repl_len) && p->recv_left()>=(int)sizeof(Big32)) {
+			Big32 ms;
+			p->recv(&ms,sizeof(ms));
+			p->recv_done();
+			delete p; /* hangs up */
+			if (tries>=busy_max_tries) quit("Server too busy; giving up");
+			status("Server busy; waiting to try again");
+			int wait=ms+rand()%(ms/4+1); /* spread out everybody's retries */
+			usleep(1000*wait);
+			continue;
+		}
+		if (0!=strncmp(repl,"OK",repl_len)) quit("Didn't get OK response!\n");
+		version=sand_version(sand_major,sand_minor_sha1); /* old servers just say OK */
+		if (p->recv_left()>=(int)sizeof(Big32)) {
+			Big32 agreed;
+			p->recv(&agreed,sizeof(agreed));
+			version=agreed;
+		}
+		p->recv_done();
+		return p;
+	}
+}
+
 int main(int argc,char *argv[])
 {
 	const char *tarIn=NULL;
+	const char *dirIn=NULL;
 	FILE *out=stdout;
 	const char *userName="testing";
-#define userNameMax 31
 	skt_ip_t ip;
 	unsigned int port;
 	SOCKET s;
@@ -71,18 +443,26 @@ int main(int argc,char *argv[])
 	int argi=1;
 
 	skt_init(); skt_set_abort(my_skt_abort);
+	srand(getpid());
 	while (argi<argc-1) {
 		if (argv[argi][0]=='-')
 		switch(argv[argi++][1]) {
 		case 'v': verbose++; break;
+		case 'b': batch=1; break;
+		case 't': timing=1; break;
+		case 'r': {
+			results=fopen(argv[argi++],"a");
+			if (results==NULL) quit("Can't create results file");
+		} break;
 		case 'f': tarIn=argv[argi++]; break;
+		case 'd': dirIn=argv[argi++]; break;
 		case 'o': {
 			out=fopen(argv[argi++],"w");
 			if (out==NULL) quit("Can't create output file");
 		} break;
 		case 'u': {
 			userName=argv[argi++];
-			if (strlen(userName)>=userNameMax) quit("Username too long");
+			if (strlen(userName)>sand_username_max) quit("Username too long");
 		} break;
 		default: usage("Invalid flag argument.");
 		}
@@ -92,45 +472,68 @@ int main(int argc,char *argv[])
 	if (skt_ip_match(_skt_invalid_ip,(ip=skt_lookup_ip(buf)))) 
 		  quit("Couldn't lookup host name.");
 
-	status("Connecting");
-	s=skt_connect(ip,port,10);
-	status("Authenticating");
-	auth_pipe p(MY_SHARED_SECRET,auth_pipe::dir_B,s);
+	int tarFD=-1;
+	struct stat st;
+	st.st_size=0;
+	if (!batch && dirIn!=NULL && !is_dir(dirIn)) quit("Can't open project directory");
+	if (!batch && (tarIn!=NULL || dirIn==NULL)) {
+		tarFD=open(tarIn,O_RDONLY);
+		if (tarFD<0 || 0!=fstat(tarFD,&st)) quit("Can't open tar file");
+	}
 	
-	/* Send off version number and username */
-	status("Sending version and username");
-	struct sand_head_t {
-		Big32 version; /* Version number of request */
-		char username[userNameMax+1]; /* nul-terminated username string */
-	};
-	struct sand_head_t sh;
-	sh.version=0x10000;
-	strcpy(sh.username,userName);
-	p.send(&sh,sizeof(sh));
+	auth_pipe &p=*server_connect(ip,port,userName,&s);
+	if (sand_version_minor(version)>=sand_minor_hmac) p.set_mac(auth_pipe::mac_hmac_sha256);
+	if (sand_version_minor(version)>=sand_minor_chunked) p.set_chunked(true);
 	
-	/* Want 2-byte "OK" string */
-	enum {repl_len=2};
-	p.recv_start(repl_len); 
-	if (0!=strncmp((char *)p.recv(repl_len),"OK",repl_len)) quit("Didn't get OK response!\n");
+	if (sand_version_minor(version)>=sand_minor_mux) {
+		p.set_duplex();
+		if (batch) run_batch(p,s);
+		else { /* one job, then hang up */
+			if (tarFD>=0) close(tarFD);
+			client_job j;
+			j.out=out;
+			if (dirIn!=NULL && sand_version_minor(version)>=sand_minor_cache) {
+				j.tarName=dirIn;
+				jobs[1]=j;
+				send_manifest(p,1,dirIn,jobs[1]);
+			} else {
+				if (tarIn==NULL) quit("Server is too old for -d; pass a tar file with -f too");
+				j.tarName=tarIn;
+				if (!send_job(p,1,tarIn)) quit("Can't read tar file");
+				jobs[1]=j;
+			}
+			sand_tag_t tag;
+			tag.job=0; tag.type=sand_msg_close;
+			p.send_msg(&tag,sizeof(tag));
+			while (!jobs.empty()) recv_job_msg(p);
+		}
+		status("Program complete");
+		return failures;
+	}
+	if (batch) quit("Server is too old for batch mode");
+	if (tarIn==NULL) quit("Server is too old for -d; pass a tar file with -f too");
+	if (sand_version_minor(version)<sand_minor_chunked && st.st_size>=auth_pipe::msg_max) 
+		quit("Tar file too big for this server");
 	
-	/* Read and send off tar file */
+	/* Map and send off tar file, straight out of the page cache */
 	status("Sending tar file");
-	FILE *in=fopen(tarIn,"rb");
-	int len=0;
-	do {
-		len=fread(buf,1,buf_max,in);
-		p.send(buf,len);
-	} while (len>0);
-	fclose(in);
-	p.send_done();
+	if (st.st_size>0) {
+		void *tar=mmap(0,st.st_size,PROT_READ,MAP_SHARED,tarFD,0);
+		if (tar==MAP_FAILED) quit("Can't map tar file");
+		p.send_big(tar,st.st_size);
+		munmap(tar,st.st_size);
+	}
+	else p.send_msg(NULL,0);
+	close(tarFD);
 	
 	/* Pull back program output */
 	status("Receiving program output");
-	len=0;
+	int len=0;
 	do {
 		len=p.recv_start();
 		// printf("output recv_start: %d bytes\n",len);
 		fwrite(p.recv(len),len,1,out);
+		fflush(out); /* show output as soon as it arrives */
 	} while (len>0);
 	
 	/* Pull back result code & return it */
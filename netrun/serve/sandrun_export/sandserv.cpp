@@ -4,121 +4,748 @@ client.
 
 See sandsend for description of what the server expects.
 
-WARNING: Server just aborts on errors (bad data, 
-security, even network timeouts), so be sure
-to call this in a loop!
+Connections are handled by a pool of pre-forked worker
+processes, each of which accepts one connection at a time.
+Each job runs in its own in_<time>_<n>/ directory.  Old clients
+send one job per connection; new clients can send many jobs over
+one connection, and a worker then runs several of them at 
+once, waiting on the client and all their programs with one
+epoll set (see serve_mux, sockEvents.h).  Jobs sent as manifests are built out of
+the shared file cache in cache/ (see filecache.h).  The parent 
+process just restarts any worker that dies.
+
+There are more workers than execution slots, so connections get
+answered right away even when every slot is busy.  Jobs wait for
+a slot in a queue shared by all the workers, which hands out free
+slots fairly by username (see jobqueue.h).  Clients that already 
+have too many jobs in the queue get told to come back later (old
+clients, which can't retry, get an error instead).
+
+WARNING: Workers just abort on errors (bad data, 
+security, even network timeouts), which only takes down
+that one worker.  The parent keeps running, but be sure
+to call this in a loop anyway!
+
+Usage: sandserv [ -b <cores> ] [ <port> [ <slots> [ <workers> ] ] ]
+  <slots> is how many jobs run at once, and defaults to the 
+  number of CPU cores.  <workers> defaults to 4 per slot.
+  -b reserves the last <cores> CPU cores for benchmark runs 
+  (make BENCH=1, or grading with timing): the server, compilers, 
+  and ordinary runs stay off them, and s4g_chroot gives each 
+  benchmark run one reserved core all to itself.  For the quietest 
+  cores, also boot with isolcpus=, nohz_full=, and rcu_nocbs= 
+  for those cores, and keep irqbalance off them.
 
 Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "auth_pipe.h"
 #include "sockRoutines.h"
+#include "sandrun.h"
+#include "tarstream.h"
+#include "filecache.h"
+#include "jobqueue.h"
+#include "sockEvents.h"
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
 #include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <algorithm>
 #include "config.h"
 
-int main(int argc,char *argv[])
+/* This worker's number, how many workers there are, and jobs so far */
+int worker=0, nWorkers=1, jobCount=0;
+
+/* Execution slots, and the queue of jobs waiting for them */
+int nSlots=1;
+job_queue *queue=0;
+
+/* Project files uploaded by manifest jobs, shared by all workers */
+file_cache *cache=0;
+enum {
+	cache_evict_every=100, /* jobs between cache cleanups */
+	cache_max_age=7*24*60*60 /* seconds unused before a file is removed */
+};
+
+/* Every so often, clear old files out of the cache */
+void cache_cleanup(void)
 {
-	skt_ip_t ip;
-	unsigned int port=2983;
-	int clientCount=0;
-	SOCKET servFD;
-	skt_init();
-	if (argc>1) port=atoi(argv[1]);
-	servFD=skt_server(&port);
-	system("echo 'CWD: '`pwd`\"; PATH='$PATH'; ID=`id`; PID=$$\"");
-	while (1)
-	{
+	static int nJobs=0;
+	if (++nJobs%cache_evict_every!=0) return;
+	int n=cache->evict(cache_max_age);
+	fprintf(stdout,"SERVER %d> Removed %d old files from cache\n",worker,n);
+	fflush(stdout);
+}
+
+/* One job, from upload to result, in its own in_<time>_<n>/ directory.
+  Paths all include the directory, so one worker can have several
+  jobs going at once.
+*/
+class sand_job {
+public:
+	std::string dir; /* job directory, with trailing slash */
+	FILE *info; /* info.txt log, while unpacking */
+	tar_extract *tar; /* unpacks the upload as it arrives */
+	std::string manifestText; /* manifest upload, as it arrives */
+	std::set<std::string> need; /* hashes of files we're waiting for */
+	FILE *run; /* make process running the job */
+	FILE *out; /* copy of the program output, for the logs */
+	long inBytes, outBytes;
+	/* When each phase ended (see now), and total time spent sending output */
+	double tCreate, tReceived, tReady, tStart, tDone, sendTime;
+	
+	sand_job() :info(0),tar(0),run(0),out(0),inBytes(0),outBytes(0),
+		tCreate(0),tReceived(0),tReady(0),tStart(0),tDone(0),sendTime(0) {}
+	~sand_job() {delete tar;}
+	
+	/* Make a job directory no other worker (or earlier run) is using,
+	  and log who's asking. */
+	void create(const sand_head_t &sh,skt_ip_t ip,unsigned int port) {
+		tCreate=now();
 		char dest[100];
-		fprintf(stdout,"SERVER> Waiting for incoming requests on port %u\n",port);
+		while (1) {
+			sprintf(dest,"in_%ld_%d/",(long)time(NULL),(jobCount++)*nWorkers+worker);
+			dir=dest;
+			if (0==mkdir(dir.c_str(),0700)) break;
+			if (errno!=EEXIST) skt_call_abort("Error creating directory");
+		}
+		shell("date > "+dir+"info.txt");
+		system("date");
+		info=fopen((dir+"info.txt").c_str(),"ae");
+		if (info==0) skt_call_abort("Error creating info file");
+		fprintf(info,"User '%s', vers %x, source %s:%u\n",
+			sh.username,(int)sh.version,skt_print_ip(dest,ip),port);
+		mkdir((dir+"run").c_str(),0777);
+	}
+	
+	/* Unpack these bytes of the tarfile */
+	void unpack(const void *buf,int len) {
+		if (tar==0) {
+			fprintf(info,"   Tarfile contains:");
+			tar=new tar_extract(dir+"run/",info);
+		}
+		tar->add(buf,len);
+		inBytes+=len;
+	}
+	
+	/* The whole tarfile has arrived */
+	void unpacked(const sand_head_t &sh) {
+		tReceived=now(); /* (tar files unpack as they arrive) */
+		tar->finish();
+		tar->strip_top_dir(); /* pull out top-level directory (if one exists) */
+		fprintf(stdout,"SERVER %d> Received %ld-byte file (%d files) from user '%s' (vers %x) into '%s'\n",
+			worker,inBytes,tar->count(),sh.username,(int)sh.version,dir.c_str());
 		fflush(stdout);
-		SOCKET s=skt_accept(servFD,&ip,&port);
-		fprintf(stdout,"SERVER> Connect from %s:%u\n", skt_print_ip(dest,ip),port);
+		delete tar; tar=0;
+		fclose(info); info=0;
+		tReady=now();
+	}
+	
+	/* Add these bytes to the manifest */
+	void add_manifest(const void *buf,int len) {
+		manifestText.append((const char *)buf,len);
+		inBytes+=len;
+		if (inBytes>=auth_pipe::msg_max) skt_call_abort("Security error: manifest too long!");
+	}
+	
+	/* The whole manifest has arrived: list the files it needs
+	  that the cache doesn't have yet. */
+	void manifest(const file_cache &cache) {
+		std::string::size_type at=0, nl;
+		while ((nl=manifestText.find('\n',at))!=std::string::npos) {
+			std::string line=manifestText.substr(at,nl-at);
+			at=nl+1;
+			char hex[65];
+			osl::SHA256_hash_t h;
+			if (1==sscanf(line.c_str(),"f %64s",hex) && file_cache::unhex(hex,h) && !cache.has(h))
+				need.insert(std::string((const char *)h.data,sizeof(h.data)));
+		}
+	}
+	
+	/* Everything in the manifest is in the cache: make the run directory.
+	  Returns false, listing the missing files in need, if some of them
+	  left the cache (evicted by another worker) before we got to them. */
+	bool materialize(file_cache &cache,const sand_head_t &sh) {
+		tReceived=now();
+		std::string listing;
+		std::string runDir=dir+"run/";
+		std::string::size_type at=0, nl;
+		int nFiles=0;
+		while ((nl=manifestText.find('\n',at))!=std::string::npos) {
+			std::string line=manifestText.substr(at,nl-at);
+			at=nl+1;
+			char hex[65];
+			unsigned int mode=0;
+			long mtime=0;
+			int nameAt=0;
+			osl::SHA256_hash_t h;
+			bool isFile=(3==sscanf(line.c_str(),"f %64s %o %ld %n",hex,&mode,&mtime,&nameAt)) && nameAt>0
+				&& file_cache::unhex(hex,h);
+			bool isDir=!isFile && (1==sscanf(line.c_str(),"d %o %n",&mode,&nameAt)) && nameAt>0;
+			if (!isFile && !isDir) continue;
+			std::string name=line.substr(nameAt);
+			std::string rel=tar_safe_name(name);
+			if (rel=="") {
+				listing+=name+" (skipped: unsafe name)\n";
+				continue;
+			}
+			listing+=name+"\n";
+			tar_make_parents(runDir,rel);
+			if (isDir) mkdir((runDir+rel).c_str(),(mode&0777)|0700);
+			else if (!cache.materialize(h,runDir+rel,mode&0777,mtime))
+				need.insert(std::string((const char *)h.data,sizeof(h.data)));
+			nFiles++;
+		}
+		if (!need.empty()) return false; /* try again once they're back */
+		fprintf(info,"   Manifest contains:%s",listing.c_str());
+		fprintf(stdout,"SERVER %d> Received %ld-byte manifest (%d files) from user '%s' (vers %x) into '%s'\n",
+			worker,inBytes,nFiles,sh.username,(int)sh.version,dir.c_str());
 		fflush(stdout);
+		manifestText="";
+		fclose(info); info=0;
+		tReady=now();
+		return true;
+	}
+	
+	/* Start the program running */
+	void start(void) {
+		tStart=now();
+		/* The netrun scripts add their own phases to the timing file */
+		char cwd[1024];
+		if (getcwd(cwd,sizeof(cwd))==NULL) skt_call_abort("Error getting current directory");
+		run=popen(("cd "+dir+"run; NETRUN_TIMING="+cwd+"/"+dir+"timing.txt "
+			"S4G_REPORT="+cwd+"/"+dir+"usage.txt NETRUN_RESULTS=results.jsonl "
+			"make sandrun < /dev/null 2>&1").c_str(),"re");
+		if (run==NULL) skt_call_abort("Error starting make");
+		out=fopen((dir+"output").c_str(),"wb");
+		if (out==NULL) skt_call_abort("Error creating output file");
+	}
+	
+	/* Return the file descriptor program output comes from */
+	int output_fd(void) const {return fileno(run);}
+	
+	/* Read whatever program output is ready, up to len bytes.
+	  Returns 0 once the program is done, or -1 if the output
+	  is non-blocking and there's nothing to read yet. */
+	int read_output(void *buf,int len) {
+		int n;
+		do { n=read(fileno(run),buf,len); } while (n<0 && errno==EINTR);
+		if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return -1;
+		if (n<=0) return 0;
+		outBytes+=n;
+		fwrite(buf,n,1,out);
+		return n;
+	}
+	
+	/* Log the output, clean up, and return make's result code */
+	int finish(void) {
+		fclose(out); out=0;
+		int result=pclose(run); run=0;
+		tDone=now();
 		
-		auth_pipe p(MY_SHARED_SECRET,auth_pipe::dir_A,s);
-		
-		// Receive header--version and username
-		struct sand_head_t {
-			Big32 version; /* Version number of request */
-			char username[32]; /* nul-terminated username string */
-		};
-		struct sand_head_t sh;
-		p.recv_start(sizeof(sh));
-		p.recv(&sh,sizeof(sh));
-		
-		int version=sh.version;
-		if ((version>>16)!=1) skt_call_abort("Incorrect major version in request!");
-		
-		// Reply that it's now OK to send tarfile
-		p.send("OK",2);
-		
-		// Write name to disk
-		sprintf(dest,"in_%ld_%d/",(long)time(NULL),clientCount++);
-		std::string runDir=dest;
-		if (0!=mkdir(runDir.c_str(),0700)) skt_call_abort("Error creating directory");
-		if (0!=chdir(runDir.c_str())) skt_call_abort("Error cd'ing to directory");
-		system("date > info.txt");
-		system("date");
-		FILE *info=fopen("info.txt","a");
-		if (info==0) skt_call_abort("Error creating info file");
-		fprintf(info,"User '%s', vers %x, source %s:%u\n   Tarfile contains:",
-			sh.username,version,skt_print_ip(dest,ip),port);
-		fclose(info);
+		shell("echo 'Program output:'; cat "+dir+"output");
+		shell("echo 'Program output:' >> "+dir+"info.txt; cat "+dir+"output >> "+dir+"info.txt");
+		/* Timing results, from inside the jail (or outside, without one) */
+		add_results(dir+"run/run/results.jsonl");
+		add_results(dir+"run/results.jsonl");
+		shell("rm -fr "+dir+"run"); /* clean up */
 		
-		// Receive and write tarfile to disk
-		int len=p.recv_start();
-		fprintf(stdout,"SERVER> Receiving %d-byte file from user '%s' (vers %x) into '%s'\n",
-			len,sh.username,version,runDir.c_str());
+		fprintf(stdout,"SERVER %d> Program finished (result %d, %ld bytes of output) \n",worker,result,outBytes);
 		fflush(stdout);
-		const char *tarName="in.tar";
-		unlink(tarName);
-		FILE *tar=fopen(tarName,"wb");
-		if (tar==NULL) skt_call_abort("Error creating tarfile");
-		if (1!=fwrite(p.recv(len),len,1,tar)) skt_call_abort("Error writing tarfile");
-		fclose(tar);
-		p.recv_done();
 		
-		// Unpack tarfile
-		mkdir("run",0777);
-		if (0!=system("tar -C run -xvf in.tar | tee -a info.txt")) skt_call_abort("Error unpacking tarfile");
-		// Pull out top-level directory (if one exists)
-		system("cd run; [ -d * ] && mv */* .");
-		
-		// Run program, redirecting output to file
-		int result=system("cd run; make sandrun < /dev/null > ../output 2>&1");
+		phase("receive",tReceived-tCreate);
+		phase("unpack",tReady-tReceived);
+		phase("wait",tStart-tReady);
+		phase("make",tDone-tStart); /* (output is sent while make runs) */
+		phase("send",sendTime);
+		FILE *f=fopen((dir+"timing.txt").c_str(),"r");
+		if (f) { /* phases inside make, from the netrun scripts */
+			char line[200];
+			while (fgets(line,sizeof(line),f)) trailer+=line;
+			fclose(f);
+		}
+		f=fopen((dir+"usage.txt").c_str(),"r");
+		if (f) { /* resources used by each sandboxed run, from s4g_chroot */
+			char line[1024];
+			while (fgets(line,sizeof(line),f)) 
+				if (strchr(line,'\n')) trailer+=std::string("usage ")+line;
+			fclose(f);
+		}
+		phase("cleanup",now()-tDone);
+		return result;
+	}
+	
+	/* Key/value lines to send back after the job, like "phase run 1234" */
+	std::string trailer;
+	
+	/* Add the JSON lines the timing harness wrote to this file (which
+	  the user's program controls, so be careful) as "result" lines. */
+	void add_results(const std::string &path) {
+		int fd=open(path.c_str(),O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+		if (fd<0) return;
+		struct stat st;
+		FILE *f=0;
+		if (0==fstat(fd,&st) && S_ISREG(st.st_mode)) f=fdopen(fd,"r");
+		if (f==0) { close(fd); return; }
+		enum {max_line=8192, max_total=1024*1024};
+		char line[max_line];
+		int total=0, partial=0;
+		while (total<max_total && fgets(line,sizeof(line),f)) {
+			bool whole=(strchr(line,'\n')!=0);
+			if (whole && !partial && line[0]=='{') {
+				trailer+=std::string("result ")+line;
+				total+=strlen(line);
+			}
+			partial=!whole; /* skip the rest of overlong lines */
+		}
+		fclose(f);
+	}
+	
+	/* Add this phase's time to the trailer, in microseconds */
+	void phase(const char *name,double seconds) {
+		char line[100];
+		sprintf(line,"phase %s %ld\n",name,(long)(seconds*1.0e6));
+		trailer+=line;
+	}
+	
+	/* Return a time in seconds, for timing phases */
+	static double now(void) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		return ts.tv_sec+1.0e-9*ts.tv_nsec;
+	}
+	
+private:
+	static void shell(const std::string &cmd) {system(cmd.c_str());}
+};
+
+/* Original protocol: receive one job, run it, and send back the output.
+  ticket is the queue place the connection was admitted with. */
+void serve_one(auth_pipe &p,const sand_head_t &sh,int ticket,skt_ip_t ip,unsigned int port)
+{
+	sand_job job;
+	job.create(sh,ip,port);
+	
+	// Receive tarfile, streaming it straight into tar as it arrives
+	do {
+		int n=p.recv_start();
+		job.unpack(p.recv(n),n);
+	} while (p.recv_more());
+	p.recv_done();
+	job.unpacked(sh);
+	
+	// Wait our turn, in the place we were admitted with
+	queue->ready(ticket);
+	queue->wait_start(ticket);
+	
+	// Run program, streaming its output back as it's produced
+	job.start();
+	enum {buf_max=4096};
+	unsigned char buf[buf_max];
+	int n;
+	while ((n=job.read_output(buf,buf_max))>0) 
+		p.send_msg(buf,n);
+	
+	// Zero-length message marks the end of the output
+	p.send_msg(NULL,0);
+	
+	// Send off result code
+	Big32 r(job.finish());
+	queue->done(ticket);
+	p.send_msg(&r,sizeof(r));
+	cache_cleanup();
+}
+
+/* A job submitted over a mux connection */
+struct mux_job {
+	Big32 id; /* the client's job ID */
+	int ticket; /* our place in the job queue, or -1 if not in it yet */
+	sand_job job;
+	mux_job() :ticket(-1) {}
+};
+
+/* Queue this tagged message for the client */
+void mux_send(auth_pipe &p,Big32 job,int type,const void *buf,int len)
+{
+	sand_tag_t tag;
+	tag.job=job; tag.type=type;
+	const void *bufs[2]={&tag,buf};
+	int lens[2]={sizeof(tag),len};
+	p.send_msgV(len>0?2:1,bufs,lens);
+}
+
+/* Ask the client for the files this job needs that we haven't 
+  already asked it for (maybe none). */
+void mux_ask(auth_pipe &p,mux_job *j,std::set<std::string> &asked)
+{
+	std::string ask;
+	for (std::set<std::string>::iterator it=j->job.need.begin();it!=j->job.need.end();++it)
+		if (asked.insert(*it).second) ask+=*it;
+	mux_send(p,j->id,sand_msg_need,ask.data(),ask.size());
+}
+
+/* Mux protocol: receive any number of jobs, and run them as the job
+  queue gives us slots, forwarding their output as it's produced.
+  
+  We always keep reading from the client (extra jobs wait on disk, up
+  to sand_mux_jobs_max of them), buffering each message until all of
+  it has arrived, so a slow upload never holds up the running jobs.
+  We never wait to send: replies go in the pipe's queue, which leaves
+  as the socket can take it.  Program output is only read while the
+  queue is short, so a client that's slow to read stalls its programs,
+  not us.
+*/
+void serve_mux(auth_pipe &p,SOCKET s,const sand_head_t &sh,int minor,int ticket,skt_ip_t ip,unsigned int port)
+{
+	p.set_duplex();
+	p.set_queued(true);
+	skt_set_nonblocking(s,1);
+	mux_job *uploading=0; /* job whose tarfile or manifest is arriving */
+	int uploadType=0; /* sand_msg_tar or sand_msg_manifest */
+	std::vector<mux_job *> fetching; /* manifest in, waiting for files */
+	std::set<std::string> asked; /* hashes asked for, not yet arrived */
+	file_cache::writer *fileUp=0; /* file whose pieces are arriving */
+	std::deque<mux_job *> waiting; /* unpacked, waiting to run */
+	std::vector<mux_job *> running;
+	bool closing=false; /* client has no more jobs */
+	int nJobs=0, nDone=0;
+	skt_events ev;
+	ev.add(s,0);
+	int slotTimer=0; /* timer to check the queue again, or 0 */
+	while (!closing || uploading || !fetching.empty() || !waiting.empty() || !running.empty())
+	{
+		// Start jobs as the queue hands us slots
+		for (unsigned int i=0;i<waiting.size();) {
+			mux_job *j=waiting[i];
+			if (j->ticket==-1) {
+				if (ticket!=-1) { /* first job uses the connection's place */
+					j->ticket=ticket;
+					queue->ready(ticket);
+					ticket=-1;
+				}
+				else j->ticket=queue->enqueue(sh.username); /* -1: try later */
+			}
+			if (j->ticket!=-1 && queue->try_start(j->ticket)) {
+				j->job.start();
+				skt_set_nonblocking(j->job.output_fd(),1);
+				ev.add(j->job.output_fd(),0,j);
+				running.push_back(j);
+				waiting.erase(waiting.begin()+i);
+			}
+			else i++;
+		}
 		
-		// Send off program output (FIXME: stream this out--don't wait until end)
-		FILE *out=fopen("output","rb");
-		int totOutput=0;
-		do {
-			enum {buf_max=1024};
-			unsigned char buf[buf_max];
-			len=fread(buf,1,buf_max,out);
-			totOutput+=len;
-			p.send(buf,len);
-			// printf("output send: %d bytes\n",len);
-			p.send_done();
-		} while (len>0);
-		fclose(out);
+		// Only listen to programs while the send queue is short
+		enum {queue_max=64*1024}; /* bytes */
+		bool canSend=p.send_left()<queue_max;
+		bool reading=!closing || !asked.empty(); /* files can arrive after close */
+		ev.modify(s,(reading?skt_events::in:0)|
+			(p.send_left()>0?skt_events::out:0));
+		for (unsigned int i=0;i<running.size();i++)
+			ev.modify(running[i]->job.output_fd(),canSend?skt_events::in:0);
+		if (!waiting.empty() && slotTimer==0)
+			slotTimer=ev.timer(20); /* ms; check back for a slot */
 		
-		system("echo 'Program output:'; cat output");
-		system("echo 'Program output:' >> info.txt; cat output >> info.txt");
+		enum {ready_max=64};
+		skt_event ready[ready_max];
+		int nReady=ev.wait(ready,ready_max);
+		bool fromClient=false;
+		std::vector<mux_job *> talking; /* programs with output (or done) */
+		for (int r=0;r<nReady;r++) {
+			if (ready[r].events&skt_events::timeout) slotTimer=0;
+			else if (ready[r].fd==s) {
+				fromClient=(ready[r].events&skt_events::in);
+				if (ready[r].events&(skt_events::out|skt_events::hup)) p.send_some();
+			}
+			else talking.push_back((mux_job *)ready[r].data);
+		}
 		
-		// Send off result code
-		Big32 r(result);
-		p.send(&r,sizeof(r));
-		p.send_done();
+		// Incoming message from the client, once it's all here
+		if (reading && fromClient && p.recv_some()) {
+			int n=p.recv_start();
+			sand_tag_t tag;
+			if (n<(int)sizeof(tag)) skt_call_abort("Security error: mux message too short!");
+			p.recv(&tag,sizeof(tag));
+			n-=sizeof(tag);
+			bool more=p.recv_more();
+			int type=tag.type;
+			if (type==sand_msg_manifest && minor<sand_minor_cache) type=-1;
+			if (closing && type!=sand_msg_file) type=-1;
+			switch (type) {
+			case sand_msg_tar: case sand_msg_manifest:
+				if (uploading==0) {
+					if (nJobs-nDone>=sand_mux_jobs_max)
+						skt_call_abort("Security error: too many mux jobs at once!");
+					uploading=new mux_job;
+					uploading->id=tag.job;
+					uploading->job.create(sh,ip,port);
+					uploadType=type;
+					nJobs++;
+				}
+				else if ((int)uploading->id!=(int)tag.job || uploadType!=type)
+					skt_call_abort("Security error: upload pieces from two jobs mixed!");
+				if (type==sand_msg_tar) uploading->job.unpack(p.recv(n),n);
+				else uploading->job.add_manifest(p.recv(n),n);
+				p.recv_done();
+				if (more) break;
+				if (type==sand_msg_tar) { /* that's the whole tarfile */
+					uploading->job.unpacked(sh);
+					waiting.push_back(uploading);
+				}
+				else { /* whole manifest: ask for the files we don't have */
+					sand_job &job=uploading->job;
+					job.manifest(*cache);
+					mux_ask(p,uploading,asked);
+					if (job.need.empty() && !job.materialize(*cache,sh))
+						mux_ask(p,uploading,asked); /* some left the cache since */
+					if (job.need.empty()) waiting.push_back(uploading);
+					else fetching.push_back(uploading);
+				}
+				uploading=0;
+				break;
+			case sand_msg_file: {
+				osl::SHA256_hash_t h;
+				if (n<(int)sizeof(h)) skt_call_abort("Security error: file message too short!");
+				p.recv(&h,sizeof(h));
+				n-=sizeof(h);
+				std::string key((const char *)h.data,sizeof(h.data));
+				if (fileUp==0) {
+					if (asked.count(key)==0) skt_call_abort("Security error: file we didn't ask for!");
+					fileUp=new file_cache::writer(*cache,h);
+				}
+				else if (osl::SHA256_differ(&h,&fileUp->hash()))
+					skt_call_abort("Security error: pieces of two files mixed!");
+				fileUp->add(p.recv(n),n);
+				p.recv_done();
+				if (more) break;
+				fileUp->finish();
+				delete fileUp; fileUp=0;
+				asked.erase(key);
+				for (int i=fetching.size()-1;i>=0;i--) {
+					sand_job &job=fetching[i]->job;
+					job.need.erase(key);
+					if (!job.need.empty()) continue;
+					if (job.materialize(*cache,sh)) { /* all its files are here */
+						waiting.push_back(fetching[i]);
+						fetching.erase(fetching.begin()+i);
+					}
+					else mux_ask(p,fetching[i],asked); /* some left the cache again */
+				}
+			} break;
+			case sand_msg_close:
+				if (uploading || fileUp) skt_call_abort("Security error: close in the middle of an upload!");
+				closing=true;
+				p.recv_done();
+				break;
+			default:
+				skt_call_abort("Security error: unknown mux message type!");
+			}
+		}
 		
-		system("rm -fr run"); /* clean up */		
-		chdir("..");
+		// Program output (talking is empty unless canSend)
+		for (unsigned int i=0;i<talking.size();i++) {
+			mux_job *j=talking[i];
+			enum {buf_max=4096};
+			unsigned char buf[buf_max];
+			int n=j->job.read_output(buf,buf_max);
+			if (n>0) {
+				double t=sand_job::now();
+				mux_send(p,j->id,sand_msg_output,buf,n);
+				j->job.sendTime+=sand_job::now()-t;
+			}
+			else if (n==0) { /* program is done */
+				ev.remove(j->job.output_fd());
+				Big32 r(j->job.finish());
+				queue->done(j->ticket);
+				if (minor>=sand_minor_timing)
+					mux_send(p,j->id,sand_msg_trailer,j->job.trailer.data(),j->job.trailer.size());
+				mux_send(p,j->id,sand_msg_result,&r,sizeof(r));
+				nDone++;
+				delete j;
+				running.erase(std::find(running.begin(),running.end(),j));
+				cache_cleanup();
+			}
+		}
+	}
+	if (ticket!=-1) queue->done(ticket); /* never sent a job */
+	p.set_queued(false); /* send the last results */
+	fprintf(stdout,"SERVER %d> Connection done after %d jobs\n",worker,nJobs);
+	fflush(stdout);
+}
 
-		fprintf(stdout,"SERVER> Program finished (result %d, %d bytes of output) \n",result,totOutput);
+/* Talk to this client, and serve its job(s).
+  Runs inside a worker process, in the directory the server started in.
+*/
+void serve_client(SOCKET s,skt_ip_t ip,unsigned int port)
+{
+	auth_pipe p(MY_SHARED_SECRET,auth_pipe::dir_A,s);
+	
+	// Receive header--version and username
+	struct sand_head_t sh;
+	p.recv_start(sizeof(sh));
+	p.recv(&sh,sizeof(sh));
+	sh.username[sizeof(sh.username)-1]=0;
+	
+	int version=sh.version;
+	if ((version>>16)!=sand_major) skt_call_abort("Incorrect major version in request!");
+	
+	int minor=sand_version_minor(version);
+	if (minor>sand_minor) minor=sand_minor;
+	
+	// If they've already got too much queued up, tell them to come back later
+	//  (old clients can't wait and retry, but anything besides OK stops them)
+	int retryMs=0, ticket=queue->admit(sh.username,&retryMs);
+	if (ticket==-1) {
+		Big32 ms(retryMs);
+		const void *repl[2]={"BZ",&ms};
+		int replLen[2]={2,sizeof(ms)};
+		p.send_msgV(minor>sand_minor_sha1?2:1,repl,replLen); /* same length as OK */
+		fprintf(stdout,"SERVER %d> Busy: told user '%s' to retry in %d ms\n",worker,sh.username,retryMs);
 		fflush(stdout);
+		return;
 	}
-	return 0;
+	
+	// Reply that it's now OK to send tarfile
+	Big32 agreed(sand_version(sand_major,minor));
+	const void *repl[2]={"OK",&agreed};
+	int replLen[2]={2,sizeof(agreed)};
+	p.send_msgV(minor>sand_minor_sha1?2:1,repl,replLen); /* only new clients get the version */
+	if (minor>=sand_minor_hmac) p.set_mac(auth_pipe::mac_hmac_sha256);
+	if (minor>=sand_minor_chunked) p.set_chunked(true);
+	
+	if (minor>=sand_minor_mux) serve_mux(p,s,sh,minor,ticket,ip,port);
+	else serve_one(p,sh,ticket,ip,port);
+}
+
+/* Worker process: accept and serve clients, one at a time, forever. */
+void worker_loop(SOCKET servFD)
+{
+	skt_ip_t ip;
+	unsigned int port;
+	while (1)
+	{
+		char dest[100];
+		fprintf(stdout,"SERVER %d> Waiting for incoming requests\n",worker);
+		fflush(stdout);
+		SOCKET s=skt_accept(servFD,&ip,&port);
+		fcntl(s,F_SETFD,FD_CLOEXEC); /* keep it away from the jobs */
+		fprintf(stdout,"SERVER %d> Connect from %s:%u\n", worker,skt_print_ip(dest,ip),port);
+		fflush(stdout);
+		
+		serve_client(s,ip,port);
+	}
+}
+
+/* Write these CPUs as a list like "0-3,6" */
+static std::string cpu_list(const std::vector<int> &cpus)
+{
+	std::string ret;
+	for (unsigned int i=0;i<cpus.size();) {
+		unsigned int j=i;
+		while (j+1<cpus.size() && cpus[j+1]==cpus[j]+1) j++;
+		char buf[100];
+		if (j==i) sprintf(buf,"%d",cpus[i]);
+		else sprintf(buf,"%d-%d",cpus[i],cpus[j]);
+		if (ret!="") ret+=",";
+		ret+=buf;
+		i=j+1;
+	}
+	return ret;
 }
 
+/* Set aside the last nBench of our CPUs for benchmark runs, and keep
+  ourselves (and so everything we start) on the rest.  Tells s4g_chroot 
+  which are which via $S4G_CPUS and $S4G_BENCH_CPUS.  Returns the 
+  number of CPUs left for everything else. */
+static int reserve_bench_cpus(int nBench)
+{
+	cpu_set_t set;
+	if (0!=sched_getaffinity(0,sizeof(set),&set)) 
+		skt_call_abort("Error getting CPU affinity");
+	std::vector<int> all, shared, bench;
+	for (int c=0;c<CPU_SETSIZE;c++) if (CPU_ISSET(c,&set)) all.push_back(c);
+	if (nBench>(int)all.size()-1) nBench=all.size()-1; /* keep one to share */
+	if (nBench<=0) return all.size();
+	shared.assign(all.begin(),all.end()-nBench);
+	bench.assign(all.end()-nBench,all.end());
+	
+	CPU_ZERO(&set);
+	for (unsigned int i=0;i<shared.size();i++) CPU_SET(shared[i],&set);
+	if (0!=sched_setaffinity(0,sizeof(set),&set)) 
+		skt_call_abort("Error setting CPU affinity");
+	setenv("S4G_CPUS",cpu_list(shared).c_str(),1);
+	setenv("S4G_BENCH_CPUS",cpu_list(bench).c_str(),1);
+	fprintf(stdout,"SERVER> Benchmark CPUs %s, everything else on %s\n",
+		cpu_list(bench).c_str(),cpu_list(shared).c_str());
+	return shared.size();
+}
+
+int main(int argc,char *argv[])
+{
+	unsigned int port=2983;
+	SOCKET servFD;
+	skt_init();
+	nSlots=sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc>2 && 0==strcmp(argv[1],"-b")) {
+		nSlots=reserve_bench_cpus(atoi(argv[2]));
+		argc-=2; argv+=2;
+	}
+	if (argc>1) port=atoi(argv[1]);
+	if (argc>2) nSlots=atoi(argv[2]);
+	if (nSlots<1) nSlots=1;
+	nWorkers=4*nSlots;
+	if (argc>3) nWorkers=atoi(argv[3]);
+	if (nWorkers<1) nWorkers=1;
+	int maxJobs=(4*nWorkers>256)?4*nWorkers:256;
+	int userMax=(nSlots>2)?nSlots:2;
+	queue=new job_queue(nSlots,maxJobs,userMax);
+	servFD=skt_server(&port);
+	fcntl(servFD,F_SETFD,FD_CLOEXEC);
+	cache=new file_cache("cache/");
+	system("echo 'CWD: '`pwd`\"; PATH='$PATH'; ID=`id`; PID=$$\"");
+	fprintf(stdout,"SERVER> Starting %d workers for %d slots on port %u\n",nWorkers,nSlots,port);
+	fflush(stdout);
+	
+	// Fork off workers, and restart any that die
+	std::vector<pid_t> workers(nWorkers,0);
+	while (1)
+	{
+		for (int w=0;w<nWorkers;w++) 
+		if (workers[w]==0) {
+			pid_t pid=fork();
+			if (pid==0) { /* we're the worker */
+				worker=w;
+				worker_loop(servFD);
+				exit(0);
+			}
+			if (pid<0) { perror("fork"); sleep(1); continue; }
+			workers[w]=pid;
+		}
+		
+		int status=0;
+		pid_t pid=wait(&status);
+		if (pid<0) {
+			if (errno==EINTR) continue;
+			skt_call_abort("Error waiting for workers");
+		}
+		for (int w=0;w<nWorkers;w++) 
+		if (workers[w]==pid) {
+			fprintf(stdout,"SERVER> Worker %d (pid %d) died (status 0x%x), restarting\n",
+				w,(int)pid,status);
+			fflush(stdout);
+			workers[w]=0;
+			queue->cleanup(pid); /* free up any slots it had */
+		}
+		sleep(1); /* don't spin if workers die immediately */
+	}
+	return 0;
+}
@@ -0,0 +1,142 @@
+/* Waiting for many sockets at once, via epoll.
+
+Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+*/
+#include "sockEvents.h"
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+skt_events::skt_events()
+	:lastTimer(0)
+{
+	ep=epoll_create1(EPOLL_CLOEXEC);
+	if (ep<0) skt_call_abort("Error creating epoll set");
+}
+
+skt_events::~skt_events()
+{
+	for (std::map<SOCKET,watch *>::iterator it=fds.begin();it!=fds.end();++it)
+		delete it->second;
+	close(ep);
+}
+
+double skt_events::now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+1.0e-9*ts.tv_nsec;
+}
+
+/* Tell epoll this socket's new events.  Sockets with no events
+  aren't in the epoll set at all, since epoll always reports hangups. */
+void skt_events::control(int old,watch *w)
+{
+	int op=EPOLL_CTL_MOD;
+	if (w->events==0) op=EPOLL_CTL_DEL;
+	else if (old==0) op=EPOLL_CTL_ADD;
+	else if (old==w->events) return;
+	if (op==EPOLL_CTL_DEL && old==0) return;
+	struct epoll_event e;
+	e.events=0;
+	if (w->events&in) e.events|=EPOLLIN;
+	if (w->events&out) e.events|=EPOLLOUT;
+	e.data.ptr=w;
+	if (0!=epoll_ctl(ep,op,w->fd,&e))
+		skt_call_abort("Error changing epoll set");
+}
+
+void skt_events::add(SOCKET fd,int events,void *data)
+{
+	if (fds.count(fd)) skt_call_abort("Socket added to an event set twice");
+	watch *w=new watch;
+	w->fd=fd; w->events=events; w->data=data;
+	fds[fd]=w;
+	control(0,w);
+}
+
+void skt_events::modify(SOCKET fd,int events)
+{
+	std::map<SOCKET,watch *>::iterator it=fds.find(fd);
+	if (it==fds.end()) skt_call_abort("Socket modified but not in event set");
+	watch *w=it->second;
+	int old=w->events;
+	w->events=events;
+	control(old,w);
+}
+
+void skt_events::remove(SOCKET fd)
+{
+	std::map<SOCKET,watch *>::iterator it=fds.find(fd);
+	if (it==fds.end()) return;
+	if (it->second->events!=0) epoll_ctl(ep,EPOLL_CTL_DEL,fd,0);
+	delete it->second;
+	fds.erase(it);
+}
+
+int skt_events::timer(int msec,void *data)
+{
+	alarm a;
+	a.id=++lastTimer;
+	a.when=now()+0.001*msec;
+	a.data=data;
+	timers.push_back(a);
+	return a.id;
+}
+
+void skt_events::cancel(int id)
+{
+	for (unsigned int i=0;i<timers.size();i++)
+		if (timers[i].id==id) {
+			timers.erase(timers.begin()+i);
+			return;
+		}
+}
+
+int skt_events::wait(skt_event *ready,int max,int msec)
+{
+	if (max<=0) return 0;
+
+	// Don't sleep past the next timer
+	if (!timers.empty()) {
+		double next=timers[0].when;
+		for (unsigned int i=1;i<timers.size();i++)
+			if (timers[i].when<next) next=timers[i].when;
+		double left=next-now();
+		int ms=(left<=0)?0:1+(int)(1000*left); /* round up, so it's due */
+		if (msec<0 || ms<msec) msec=ms;
+	}
+
+	enum {batch=64};
+	struct epoll_event e[batch];
+	int want=(max<batch)?max:batch;
+	int n;
+	do { n=epoll_wait(ep,e,want,msec); } while (n<0 && errno==EINTR);
+	if (n<0) skt_call_abort("Error waiting on epoll set");
+
+	int r=0;
+	for (int i=0;i<n;i++) {
+		watch *w=(watch *)e[i].data.ptr;
+		ready[r].fd=w->fd;
+		ready[r].data=w->data;
+		ready[r].events=0;
+		if (e[i].events&(EPOLLIN|EPOLLHUP|EPOLLERR)) ready[r].events|=in;
+		if (e[i].events&EPOLLOUT) ready[r].events|=out;
+		if (e[i].events&(EPOLLHUP|EPOLLERR)) ready[r].events|=hup;
+		r++;
+	}
+
+	// Timers that have gone off (any that don't fit go off next time)
+	double t=now();
+	for (unsigned int i=0;i<timers.size() && r<max;) {
+		if (timers[i].when<=t) {
+			ready[r].fd=-1;
+			ready[r].events=timeout;
+			ready[r].data=timers[i].data;
+			r++;
+			timers.erase(timers.begin()+i);
+		}
+		else i++;
+	}
+	return r;
+}
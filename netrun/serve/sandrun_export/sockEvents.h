@@ -0,0 +1,111 @@
+/**************************************************************************
+ *
+ * SKT events - wait for any of many sockets (or pipes) to be ready,
+ *  or for timers to run out, using epoll.  Goes with sockRoutines.h.
+ *
+ *  Level-triggered: a socket keeps showing up as ready until you
+ *  read (or write) enough of it, so you don't have to drain it.
+ *  Use skt_set_nonblocking and skt_recv_some/skt_send_some to move
+ *  just what's ready, or the blocking routines once you know a
+ *  whole message is coming.
+ *
+ *  Waiting for events alone doesn't stop a loop from blocking: the
+ *  blocking sends (skt_sendN, skt_sendV) still wait on a full socket,
+ *  even a non-blocking one, and if the other side is busy sending to
+ *  us, it never empties.  Queue outgoing data and send it as out 
+ *  events arrive instead (see auth_pipe::set_queued).  sandserv uses 
+ *  one set per connection, inside that connection's worker process.
+ *
+ * skt_events ev;
+ *   - An empty set of sockets and timers.
+ *
+ * ev.add(SOCKET fd,int events,void *data)
+ *   - Watch this socket for these events (skt_events::in, out),
+ *     which may be 0 for now (not even reporting hangups).
+ *     data comes back with its events.
+ *
+ * ev.modify(SOCKET fd,int events)
+ *   - Change the events we're watching for on this socket.
+ *     Cheap if they didn't change, so call it every time around.
+ *
+ * ev.remove(SOCKET fd)
+ *   - Stop watching this socket.  Do this before closing it.
+ *
+ * int ev.timer(int msec,void *data)
+ *   - Come back with a skt_events::timeout event (and fd -1) after
+ *     msec milliseconds.  Timers go off once.  Returns an ID.
+ *
+ * ev.cancel(int id)
+ *   - Forget about this timer, if it hasn't gone off yet.
+ *
+ * int ev.wait(skt_event *ready,int max,int msec)
+ *   - Wait until something is ready (or for msec, if not -1),
+ *     and fill out up to max events.  Returns the number filled.
+ *     Also reports in (with hup) once a socket is closed.
+ *
+ * Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+ **************************************************************************/
+#ifndef __SOCK_EVENTS_H
+#define __SOCK_EVENTS_H
+
+#include "sockRoutines.h"
+#include <map>
+#include <vector>
+
+/* One ready socket or timer */
+struct skt_event {
+	SOCKET fd; /* or -1 for a timer */
+	int events; /* what it's ready for */
+	void *data; /* from add or timer */
+};
+
+class skt_events {
+public:
+	enum {
+		in=1, /* can recv (or accept) */
+		out=2, /* can send */
+		hup=4, /* closed, or an error (only as a result) */
+		timeout=8 /* timer went off (only as a result) */
+	};
+
+	skt_events();
+	~skt_events();
+
+	void add(SOCKET fd,int events,void *data=0);
+	void modify(SOCKET fd,int events);
+	void remove(SOCKET fd);
+
+	int timer(int msec,void *data=0);
+	void cancel(int id);
+
+	int wait(skt_event *ready,int max,int msec=-1);
+
+	/* Number of sockets being watched */
+	int size(void) const {return fds.size();}
+
+private:
+	int ep; /* epoll file descriptor */
+	struct watch {
+		SOCKET fd;
+		int events;
+		void *data;
+	};
+	std::map<SOCKET,watch *> fds;
+	struct alarm {
+		int id;
+		double when; /* time in seconds */
+		void *data;
+	};
+	std::vector<alarm> timers;
+	int lastTimer;
+
+	void control(int oldEvents,watch *w);
+	/* Return the current time in seconds */
+	static double now(void);
+
+	/* Don't copy these */
+	skt_events(const skt_events &);
+	void operator=(const skt_events &);
+};
+
+#endif /*SOCK_EVENTS_H*/
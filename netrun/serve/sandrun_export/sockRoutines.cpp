@@ -173,6 +173,86 @@ int skt_select1(SOCKET fd,int msec)
   return 0;/*Timed out*/
 }
 
+#if !(defined(_WIN32) && !defined(__CYGWIN__))
+#include <poll.h>
+/*Sleep on given write socket until msec or writable*/
+int skt_select1_write(SOCKET fd,int msec)
+{
+  struct pollfd p;
+  int n;
+  p.fd=fd; p.events=POLLOUT; p.revents=0;
+  do {
+    skt_ignore_SIGPIPE=1;
+    n=poll(&p,1,msec);
+    skt_ignore_SIGPIPE=0;
+  } while (n<0 && errno==EINTR);
+  if (n<0) skt_abort(93210,"Fatal error in poll");
+  return n>0;
+}
+
+/*Return 1 if the last call failed only because a
+non-blocking socket wasn't ready.*/
+static int skt_would_block(void)
+{
+  return errno==EAGAIN || errno==EWOULDBLOCK;
+}
+
+void skt_set_nonblocking(SOCKET fd,int on)
+{
+  int flags=fcntl(fd,F_GETFL,0);
+  if (flags<0) skt_abort(93220,"Error getting socket flags");
+  if (on) flags|=O_NONBLOCK; else flags&=~O_NONBLOCK;
+  if (fcntl(fd,F_SETFL,flags)<0) skt_abort(93221,"Error setting socket flags");
+}
+
+int skt_recv_some(SOCKET fd,void *buf,int nBytes)
+{
+  int n;
+  do {
+    skt_ignore_SIGPIPE=1;
+    n=recv(fd,buf,nBytes,0);
+    skt_ignore_SIGPIPE=0;
+  } while (n<0 && errno==EINTR);
+  if (n==0) return -1; /*Closed*/
+  if (n<0) {
+    if (skt_would_block()) return 0;
+    return skt_abort(93660+fd,"Error on socket recv!");
+  }
+  return n;
+}
+
+int skt_send_some(SOCKET fd,const void *buf,int nBytes)
+{
+  int n;
+  do {
+    skt_ignore_SIGPIPE=1;
+    n=send(fd,buf,nBytes,0);
+    skt_ignore_SIGPIPE=0;
+  } while (n<0 && errno==EINTR);
+  if (n<0) {
+    if (skt_would_block()) return 0;
+    return skt_abort(93710+fd,"Error on socket send!");
+  }
+  return n;
+}
+#else
+/*Sleep on given write socket until msec or writable*/
+int skt_select1_write(SOCKET fd,int msec)
+{
+  fd_set wfds;
+  struct timeval tmo;
+  int n;
+  FD_ZERO(&wfds);
+  FD_SET(fd, &wfds);
+  tmo.tv_sec=msec/1000;
+  tmo.tv_usec=(msec%1000)*1000;
+  n=select(1+fd, NULL, &wfds, NULL, &tmo);
+  if (n<0) skt_abort(93210,"Fatal error in select");
+  return n>0;
+}
+#define skt_would_block() 0
+#endif
+
 
 /******* DNS *********/
 skt_ip_t _skt_invalid_ip={{0}};
@@ -303,7 +383,7 @@ retry:
   
   if (bind(ret, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) 
 	  return skt_abort(93484,"Error binding server socket.");
-  if (listen(ret,5) == SOCKET_ERROR) 
+  if (listen(ret,SOMAXCONN) == SOCKET_ERROR) /* a whole lab may connect at once */
 	  return skt_abort(93485,"Error listening on server socket.");
   len = sizeof(addr);
   if (getsockname(ret, (struct sockaddr *)&addr, &len) == SOCKET_ERROR) 
@@ -388,6 +468,7 @@ int skt_recvN(SOCKET hSocket,void *buff,int nBytes)
     if (nRead<=0)
     {
        if (nRead==0) return skt_abort(93620,"Socket closed before recv.");
+       if (skt_would_block()) continue;/*Non-blocking socket: select again*/
        if (skt_should_retry()) continue;/*Try again*/
        else return skt_abort(93650+hSocket,"Error on socket recv!");
     }
@@ -414,6 +495,11 @@ int skt_sendN(SOCKET hSocket,const void *buff,int nBytes)
     if (nWritten<=0)
     {
           if (nWritten==0) return skt_abort(93720,"Socket closed before send.");
+	  if (skt_would_block()) { /*Non-blocking socket: wait for room*/
+	    if (0==skt_select1_write(hSocket,120*1000))
+	      return skt_abort(93730,"Timeout on socket send!");
+	    continue;
+	  }
 	  if (skt_should_retry()) continue;/*Try again*/
 	  else return skt_abort(93700+hSocket,"Error on socket send!");
     }
@@ -426,6 +512,7 @@ int skt_sendN(SOCKET hSocket,const void *buff,int nBytes)
   return 0;
 }
 
+#if defined(_WIN32) && !defined(__CYGWIN__) /*Windows systems:*/
 /*Cheezy vector send: 
   really should use writev on machines where it's available. 
 */
@@ -455,6 +542,54 @@ int skt_sendV(SOCKET fd,int nBuffers,const void **bufs,int *lens)
 		return 0;
 	}
 }
+#else /*UNIX Systems:*/
+#include <sys/uio.h>
+/* Vector send via writev: all the buffers go out in 
+  one system call (and usually one packet), with no copying.
+*/
+int skt_sendV(SOCKET fd,int nBuffers,const void **bufs,int *lens)
+{
+  struct iovec iov[skt_sendV_maxBuffers];
+  struct iovec *v=iov;
+  int b,n=0;
+  if (nBuffers>skt_sendV_maxBuffers) 
+	return skt_abort(93740,"Too many buffers passed to skt_sendV");
+  for (b=0;b<nBuffers;b++) 
+    if (lens[b]>0) { /* skip empty buffers */
+      iov[n].iov_base=(void *)bufs[b];
+      iov[n].iov_len=lens[b];
+      n++;
+    }
+  while (n>0)
+  {
+    ssize_t nWritten;
+    skt_ignore_SIGPIPE=1;
+    nWritten = writev(fd,v,n);
+    skt_ignore_SIGPIPE=0;
+    if (nWritten<=0)
+    {
+      if (nWritten==0) return skt_abort(93720,"Socket closed before send.");
+      if (skt_would_block()) { /*Non-blocking socket: wait for room*/
+        if (0==skt_select1_write(fd,120*1000))
+          return skt_abort(93730,"Timeout on socket send!");
+        continue;
+      }
+      if (skt_should_retry()) continue;/*Try again*/
+      else return skt_abort(93700+fd,"Error on socket send!");
+    }
+    /* Advance past whatever got written (possibly part of a buffer) */
+    while (n>0 && nWritten>=(ssize_t)v->iov_len) {
+      nWritten-=v->iov_len;
+      v++; n--;
+    }
+    if (n>0) {
+      v->iov_base=(char *)v->iov_base+nWritten;
+      v->iov_len-=nWritten;
+    }
+  }
+  return 0;
+}
+#endif
 
 #endif /*!CMK_NO_SOCKETS*/
 
@@ -78,18 +78,34 @@
  *     the socket can recv or accept, or (failing that) in the given
  *     number of milliseconds.  Returns 0 on timeout; 1 on readable.
  *
+ * int skt_select1_write(SOCKET fd,int msec)
+ *   - Like skt_select1, but waits until the socket can send.
+ *
  * int skt_recvN(SOCKET fd,      void *buf,int nBytes)
  * int skt_sendN(SOCKET fd,const void *buf,int nBytes)
  *   - Blocking send/recv nBytes on the given socket.
  *     Retries if possible (e.g., if interrupted), but aborts 
  *     on serious errors.  Returns zero or an abort code.
+ *     These work on non-blocking sockets too (they wait).
+ *
+ * void skt_set_nonblocking(SOCKET fd,int on)
+ *   - Make sends and recvs on this socket (or pipe) return 
+ *     immediately, rather than waiting, if on is nonzero.
+ *
+ * int skt_recv_some(SOCKET fd,      void *buf,int maxBytes)
+ * int skt_send_some(SOCKET fd,const void *buf,int maxBytes)
+ *   - Non-blocking partial send/recv: transfer whatever the socket
+ *     can take or has ready right now, up to maxBytes.  Returns
+ *     the number of bytes moved, which is 0 if the socket isn't
+ *     ready.  skt_recv_some returns -1 once the other side closes.
+ *     See sockEvents.h for finding out when sockets are ready.
  *
  * int skt_sendV(SOCKET fd,int nBuffers,void **buffers,int *lengths)
  *   - Blocking call to write from several buffers.  This is much more
  *     performance-critical than read-from-several buffers, because 
  *     individual sends go out as separate network packets, and include
- *     a (35 ms!) timeout for subsequent short messages.  Don't use more
- *     than 8 buffers.
+ *     a (35 ms!) timeout for subsequent short messages.  Uses a single
+ *     writev on UNIX.  Don't use more than skt_sendV_maxBuffers buffers.
  * 
  * void skt_set_idle(idleFunc f)
  *   - Specify a routine to be called while waiting for the network.
@@ -164,13 +180,20 @@ SOCKET skt_connect(skt_ip_t ip, int port, int timeout);
 /*Utility*/
 void skt_close(SOCKET fd);
 int skt_select1(SOCKET fd,int msec);
+int skt_select1_write(SOCKET fd,int msec);
 void skt_setSockBuf(SOCKET skt, int bufsize);
 
 /*Blocking Send/Recv*/
 int skt_sendN(SOCKET hSocket,const void *pBuff,int nBytes);
 int skt_recvN(SOCKET hSocket,      void *pBuff,int nBytes);
+#define skt_sendV_maxBuffers 16
 int skt_sendV(SOCKET fd,int nBuffers,const void **buffers,int *lengths);
 
+/*Non-blocking Send/Recv*/
+void skt_set_nonblocking(SOCKET fd,int on);
+int skt_send_some(SOCKET fd,const void *buf,int maxBytes);
+int skt_recv_some(SOCKET fd,      void *buf,int maxBytes);
+
 
 
 
@@ -0,0 +1,261 @@
+/* Streaming tar file extraction.
+
+Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+*/
+#include "tarstream.h"
+#include "sockRoutines.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* Offsets and lengths of the ustar header fields we use */
+enum {
+	tar_name=0, tar_name_len=100,
+	tar_mode=100, tar_mode_len=8,
+	tar_size=124, tar_size_len=12,
+	tar_mtime=136, tar_mtime_len=12,
+	tar_chksum=148, tar_chksum_len=8,
+	tar_type=156,
+	tar_magic=257, /* "ustar\0" for POSIX, "ustar  \0" for GNU */
+	tar_prefix=345, tar_prefix_len=155 /* POSIX only */
+};
+
+/* Longest long name or pax header we'll hold */
+enum {meta_max=64*1024};
+
+/* Return this fixed-length, maybe-unterminated header string */
+static std::string field(const unsigned char *f,int len)
+{
+	int n=0;
+	while (n<len && f[n]!=0) n++;
+	return std::string((const char *)f,n);
+}
+
+/* Parse this octal header number (with leading spaces, and a trailing
+  space or nul).  Aborts on base-256 numbers, which only show up for
+  files far too big to be in a sandrun upload. */
+static long long octal(const unsigned char *f,int len)
+{
+	if (f[0]&0x80) skt_call_abort("Tarfile entry too big!");
+	long long v=0;
+	int i=0;
+	while (i<len && f[i]==' ') i++;
+	for (;i<len && f[i]>='0' && f[i]<='7';i++) v=v*8+(f[i]-'0');
+	return v;
+}
+
+tar_extract::tar_extract(const std::string &dir_,FILE *log_)
+	:dir(dir_),log(log_),hdrBytes(0),left(0),skip(0),done(false),
+	 zeroBlocks(0),nEntries(0),dataTo(data_skip),fd(-1),mode(0),mtime(0)
+{
+}
+
+tar_extract::~tar_extract()
+{
+	if (fd>=0) close(fd);
+}
+
+void tar_extract::add(const void *buf,int len)
+{
+	const char *p=(const char *)buf;
+	while (len>0 && !done) {
+		int n;
+		if (left>0) { /* entry data */
+			n=(left<len)?left:len;
+			entry_data(p,n);
+			left-=n;
+			if (left==0) entry_end();
+		}
+		else if (skip>0) { /* padding after the data */
+			n=(skip<len)?skip:len;
+			skip-=n;
+		}
+		else { /* next header */
+			n=block-hdrBytes;
+			if (n>len) n=len;
+			memcpy(&hdr[hdrBytes],p,n);
+			hdrBytes+=n;
+			if (hdrBytes==block) {
+				hdrBytes=0;
+				header();
+			}
+		}
+		p+=n; len-=n;
+	}
+}
+
+void tar_extract::finish(void)
+{
+	/* Real tar writes two zero blocks at the end, but some
+	   writers stop after one, or none; just don't stop mid-entry. */
+	if (left>0 || hdrBytes>0) skt_call_abort("Tarfile cut off!");
+	if (log) fflush(log);
+}
+
+void tar_extract::header(void)
+{
+	int i;
+	for (i=0;i<block;i++) if (hdr[i]!=0) break;
+	if (i==block) { /* all-zero block: end of archive */
+		if (++zeroBlocks>=2) done=true;
+		return;
+	}
+	zeroBlocks=0;
+
+	// Checksum is the sum of the header bytes, with the checksum field as spaces
+	long sum=0;
+	for (i=0;i<block;i++)
+		sum+=(i>=tar_chksum && i<tar_chksum+tar_chksum_len)?' ':hdr[i];
+	if (sum!=octal(&hdr[tar_chksum],tar_chksum_len)) skt_call_abort("Tarfile header checksum mismatch!");
+
+	long long size=octal(&hdr[tar_size],tar_size_len);
+	char type=hdr[tar_type];
+	std::string name=nextName;
+	nextName="";
+	if (name=="") {
+		name=field(&hdr[tar_name],tar_name_len);
+		if (0==memcmp(&hdr[tar_magic],"ustar\0",6)) { /* POSIX: prefix too */
+			std::string prefix=field(&hdr[tar_prefix],tar_prefix_len);
+			if (prefix!="") name=prefix+"/"+name;
+		}
+	}
+
+	left=size;
+	skip=(block-size%block)%block;
+	dataTo=data_skip;
+	if (type=='L' || type=='x') { /* long name or pax header for next entry */
+		if (size>meta_max) skt_call_abort("Tarfile long name too long!");
+		dataTo=(type=='L')?data_longname:data_pax;
+		meta="";
+	}
+	else if (type=='0' || type=='\0' || type=='7' || type=='5') {
+		std::string rel=tar_safe_name(name);
+		if (rel=="") {
+			if (log) fprintf(log,"%s (skipped: unsafe name)\n",name.c_str());
+		}
+		else {
+			if (log) fprintf(log,"%s\n",name.c_str());
+			nEntries++;
+			tar_make_parents(dir,rel);
+			mode=octal(&hdr[tar_mode],tar_mode_len)&0777;
+			std::string path=dir+rel;
+			if (type=='5') { /* directory */
+				if (0!=mkdir(path.c_str(),mode|0700) && errno!=EEXIST)
+					skt_call_abort("Error creating directory from tarfile");
+			}
+			else { /* regular file */
+				unlink(path.c_str()); /* replace, don't write through, what's there */
+				fd=open(path.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0600);
+				if (fd<0) skt_call_abort("Error creating file from tarfile");
+				mtime=octal(&hdr[tar_mtime],tar_mtime_len);
+				dataTo=data_file;
+			}
+		}
+	}
+	else if (type=='g' || type=='K') { /* global pax header, long link name */ }
+	else if (log) fprintf(log,"%s (skipped: type '%c')\n",name.c_str(),type);
+
+	if (left==0) entry_end();
+}
+
+void tar_extract::entry_data(const char *buf,int len)
+{
+	switch (dataTo) {
+	case data_file:
+		while (len>0) {
+			int n=write(fd,buf,len);
+			if (n<0 && errno==EINTR) continue;
+			if (n<=0) skt_call_abort("Error writing file from tarfile");
+			buf+=n; len-=n;
+		}
+		break;
+	case data_longname: case data_pax:
+		meta.append(buf,len);
+		break;
+	default: break;
+	}
+}
+
+void tar_extract::entry_end(void)
+{
+	if (dataTo==data_file) {
+		fchmod(fd,mode);
+		struct timeval tv[2];
+		tv[0].tv_sec=tv[1].tv_sec=mtime;
+		tv[0].tv_usec=tv[1].tv_usec=0;
+		futimes(fd,tv);
+		close(fd);
+		fd=-1;
+	}
+	else if (dataTo==data_longname) {
+		nextName=meta.c_str(); /* stops at the nul terminator */
+	}
+	else if (dataTo==data_pax) {
+		/* Records look like "<len> <key>=<value>\n"; we only want path */
+		std::string::size_type at=0;
+		while (at<meta.size()) {
+			long len=atol(meta.c_str()+at);
+			std::string::size_type sp=meta.find(' ',at);
+			if (len<=0 || sp==std::string::npos || at+len>meta.size()) break;
+			std::string rec=meta.substr(sp+1,at+len-sp-2); /* minus the newline */
+			if (rec.compare(0,5,"path=")==0) nextName=rec.substr(5);
+			at+=len;
+		}
+	}
+	dataTo=data_skip;
+}
+
+std::string tar_safe_name(const std::string &name)
+{
+	std::string::size_type s=0;
+	while (s<name.size() && name[s]=='/') s++; /* like tar, strip leading slashes */
+	std::string rel=name.substr(s);
+	while (rel.size()>0 && rel[rel.size()-1]=='/') rel.erase(rel.size()-1);
+	if (rel=="" || rel==".") return "";
+	std::string c="/"+rel+"/";
+	if (c.find("/../")!=std::string::npos) return "";
+	return rel;
+}
+
+void tar_make_parents(const std::string &dir,const std::string &name)
+{
+	std::string::size_type slash=0;
+	while ((slash=name.find('/',slash+1))!=std::string::npos) {
+		std::string path=dir+name.substr(0,slash);
+		if (0!=mkdir(path.c_str(),0777) && errno!=EEXIST)
+			skt_call_abort("Error creating directory from tarfile");
+	}
+}
+
+void tar_extract::strip_top_dir(void)
+{
+	// Same test as the shell's [ -d * ]: just one non-hidden entry, a directory
+	DIR *d=opendir(dir.c_str());
+	if (d==NULL) return;
+	std::string top;
+	int n=0;
+	struct dirent *e;
+	while ((e=readdir(d))!=NULL)
+		if (e->d_name[0]!='.') { top=e->d_name; n++; }
+	closedir(d);
+	struct stat st;
+	if (n!=1 || 0!=lstat((dir+top).c_str(),&st) || !S_ISDIR(st.st_mode)) return;
+
+	// Rename it out of the way first, in case it contains its own name
+	std::string tmp=dir+".tar_top_dir/";
+	if (0!=rename((dir+top).c_str(),tmp.c_str())) return;
+	d=opendir(tmp.c_str());
+	if (d!=NULL) {
+		while ((e=readdir(d))!=NULL) {
+			if (0==strcmp(e->d_name,".") || 0==strcmp(e->d_name,"..")) continue;
+			rename((tmp+e->d_name).c_str(),(dir+e->d_name).c_str());
+		}
+		closedir(d);
+	}
+	rmdir(tmp.c_str());
+}
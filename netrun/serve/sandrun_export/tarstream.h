@@ -0,0 +1,84 @@
+/* Streaming tar file extraction, straight out of received message buffers.
+
+Orion Sky Lawlor, olawlor@acm.org, 2005/09/22 (Public Domain)
+*/
+#ifndef __TARSTREAM_H
+#define __TARSTREAM_H
+
+#include <stdio.h>
+#include <string>
+
+/**
+ Unpacks a tar file into a directory as its bytes arrive, without
+ a tar process or a temporary copy on disk.
+
+ Understands POSIX ustar (including the name prefix field), GNU
+ long names ('L' entries), pax extended header paths, and old v7
+ tar files.  Makes regular files and directories, keeping their
+ permission bits and (for files) modification times.  For safety,
+ leading slashes are stripped, names with ".." are refused, and
+ links and device files are skipped with a note in the log.
+
+ Errors (corrupt headers, files we can't create) call skt_call_abort,
+ like the rest of the server.
+*/
+class tar_extract {
+public:
+	/* Unpack into this directory (which must exist, and ends in a slash),
+	   listing each name to this log file (if not NULL). */
+	tar_extract(const std::string &dir,FILE *log);
+	~tar_extract();
+
+	/* Unpack these next len bytes of the tar file. */
+	void add(const void *buf,int len);
+
+	/* The tar file is over: check it wasn't cut off. */
+	void finish(void);
+
+	/* If the directory now contains just one (non-hidden) subdirectory,
+	   as in a tarred-up project directory, move everything in it up
+	   a level and remove it. */
+	void strip_top_dir(void);
+
+	/* Number of files and directories unpacked so far */
+	int count(void) const {return nEntries;}
+
+	enum {block=512}; /* tar header and padding size */
+
+private:
+	std::string dir;
+	FILE *log;
+
+	unsigned char hdr[block]; /* header being assembled */
+	int hdrBytes; /* bytes of hdr filled so far */
+	long long left; /* bytes of current entry's data still to come */
+	int skip; /* padding bytes to skip after the data */
+	bool done; /* saw the end-of-archive blocks */
+	int zeroBlocks; /* consecutive all-zero headers */
+	int nEntries;
+
+	/* What to do with the current entry's data */
+	typedef enum {
+		data_skip=0, data_file, data_longname, data_pax
+	} data_t;
+	data_t dataTo;
+	int fd; /* file being written, for data_file */
+	int mode; /* permission bits of that file */
+	long long mtime; /* modification time of that file */
+	std::string meta; /* long name or pax header being assembled */
+	std::string nextName; /* name for the next entry, from 'L' or 'x' */
+
+	void header(void);
+	void entry_data(const char *buf,int len);
+	void entry_end(void);
+};
+
+/* Return the cleaned-up relative version of this file name from
+  a client, or an empty string if it's not safe to extract. */
+std::string tar_safe_name(const std::string &name);
+
+/* Make any missing parent directories of this relative name,
+  inside dir (which ends in a slash). */
+void tar_make_parents(const std::string &dir,const std::string &name);
+
+#endif
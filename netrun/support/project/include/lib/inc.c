@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h> /* for sysconf */
 #include <algorithm> /* for std::sort */
 #include "inc.h"
 
@@ -130,6 +132,139 @@ double time_in_seconds(void) {
 }
 #endif
 
+/**
+  Fine-grained timer for time_function, in ticks of:
+    x86: the time stamp counter (if it's invariant), read with
+      lfence before and rdtscp+lfence after, so the timed code 
+      can't leak out of the measured region.
+    AArch64: the virtual counter cntvct_el0, after an isb.
+    Elsewhere: clock_gettime(CLOCK_MONOTONIC_RAW) nanoseconds.
+  Ticks per second are calibrated against the clock at startup.
+  Set NETRUN_TIMER=gettimeofday to use time_in_seconds instead.
+*/
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <cpuid.h>
+#  define NETRUN_TIMER_TSC 1
+#endif
+
+enum {
+	timer_unknown=0,
+	timer_tsc, /* x86 rdtsc */
+	timer_cntvct, /* AArch64 virtual counter */
+	timer_raw, /* CLOCK_MONOTONIC_RAW */
+	timer_gettimeofday /* time_in_seconds */
+};
+static int timer_kind=timer_unknown;
+static int timer_rdtscp=0; /* x86 CPU has rdtscp */
+static double timer_hz=1.0e6; /* ticks per second */
+static double timer_granularity=time_in_seconds_granularity; /* seconds to time for */
+
+/* Read the clock we calibrate the cycle counter against, in seconds */
+static double timer_clock(void) {
+#ifdef CLOCK_MONOTONIC_RAW
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW,&ts);
+	return ts.tv_sec+1.0e-9*ts.tv_nsec;
+#else
+	return time_in_seconds();
+#endif
+}
+
+/* Read the timer, before the timed code: nothing earlier gets in */
+static inline unsigned long long timer_start(void) {
+	switch (timer_kind) {
+#ifdef NETRUN_TIMER_TSC
+	case timer_tsc: {
+		unsigned int lo,hi;
+		__asm__ __volatile__ ("lfence\n\trdtsc":"=a"(lo),"=d"(hi)::"memory");
+		return lo|((unsigned long long)hi<<32);
+	}
+#endif
+#ifdef __AARCH64EL__
+	case timer_cntvct: {
+		unsigned long long v;
+		__asm__ __volatile__ ("isb\n\tmrs %0, cntvct_el0":"=r"(v)::"memory");
+		return v;
+	}
+#endif
+#ifdef CLOCK_MONOTONIC_RAW
+	case timer_raw: {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_RAW,&ts);
+		return ts.tv_sec*1000000000ull+ts.tv_nsec;
+	}
+#endif
+	default:
+		return (unsigned long long)(time_in_seconds()*1.0e6);
+	}
+}
+
+/* Read the timer, after the timed code: everything earlier is done */
+static inline unsigned long long timer_stop(void) {
+#ifdef NETRUN_TIMER_TSC
+	if (timer_kind==timer_tsc && timer_rdtscp) {
+		unsigned int lo,hi,aux;
+		__asm__ __volatile__ ("rdtscp\n\tlfence":"=a"(lo),"=d"(hi),"=c"(aux)::"memory");
+		return lo|((unsigned long long)hi<<32);
+	}
+#endif
+	return timer_start();
+}
+
+/* Pick a timer, and figure out its ticks per second.  
+  Only does anything the first time it's called. */
+static void timer_setup(void) {
+	if (timer_kind!=timer_unknown) return;
+	const char *env=getenv("NETRUN_TIMER");
+	timer_kind=timer_gettimeofday;
+	timer_hz=1.0e6;
+	if (env && 0==strcmp(env,"gettimeofday")) return;
+#ifdef CLOCK_MONOTONIC_RAW
+	timer_kind=timer_raw;
+	timer_hz=1.0e9;
+#endif
+#ifdef __AARCH64EL__
+	unsigned long long f;
+	__asm__ __volatile__ ("mrs %0, cntfrq_el0":"=r"(f));
+	if (f>0) { timer_kind=timer_cntvct; timer_hz=f; }
+#endif
+#ifdef NETRUN_TIMER_TSC
+	unsigned int a,b,c,d;
+	if (__get_cpuid(0x80000007,&a,&b,&c,&d) && (d&(1<<8))) 
+	{ /* invariant TSC: ticks at a fixed rate, even when the clock speed changes */
+		if (__get_cpuid(0x80000001,&a,&b,&c,&d) && (d&(1<<27))) timer_rdtscp=1;
+		timer_kind=timer_tsc;
+		double t0=timer_clock(), t1;
+		unsigned long long c0=timer_start(), c1;
+		do { /* 10ms is plenty to get the rate to 0.01% */
+			t1=timer_clock(); c1=timer_stop();
+		} while (t1-t0<0.010);
+		timer_hz=(c1-c0)/(t1-t0);
+	}
+#endif
+	/* Time for a few thousand ticks, but at least 0.1ms, 
+	  to keep interrupts from landing in every pass */
+	timer_granularity=2000.0/timer_hz;
+	if (timer_granularity<1.0e-4) timer_granularity=1.0e-4;
+}
+
+/**
+  Return the current time in timer ticks (time stamp counter ticks, if possible).
+*/
+unsigned long long time_in_ticks(void) {
+	timer_setup();
+	return timer_stop();
+}
+
+/**
+  Return the number of timer ticks per second.
+*/
+double ticks_per_second(void) {
+	timer_setup();
+	return timer_hz;
+}
+
 /* A little empty subroutine, just to measure call/return overhead 
   inside time_fn, below. */
 CDECL int timeable_fn_empty(void) {
@@ -141,20 +276,24 @@ CDECL int timeable_fn_empty(void) {
   May run the function several times (to average out 
   timer granularity).
 */
+static unsigned int time_last_count=1; /* calls in the last timing pass */
 double time_function_onepass(timeable_fn fn)
 {
 	unsigned int i,count=1;
 	double timePer=0;
+	timer_setup();
 	for (count=1;count!=0;count*=2) {
-		double start, end, elapsed;
+		unsigned long long start, end;
+		double elapsed;
 		timer_only_dont_print=1;
-		start=time_in_seconds();
+		start=timer_start();
 		for (i=0;i<count;i++) fn();
-		end=time_in_seconds();
+		end=timer_stop();
 		timer_only_dont_print=0;
-		elapsed=end-start;
+		elapsed=(end-start)/timer_hz;
 		timePer=elapsed/count;
-		if (elapsed>time_in_seconds_granularity) /* Took long enough */
+		time_last_count=count;
+		if (elapsed>timer_granularity) /* Took long enough */
 			return timePer;
 	}
 	/* woa-- if we got here, "count" reached integer wraparound before 
@@ -162,30 +301,223 @@ double time_function_onepass(timeable_fn fn)
 	return timePer;
 }
 
+/* Seconds the last timing pass (of time_last_count calls) took */
+static double time_last_pass=0;
+
+/* Return the seconds per call to run fn count times */
+static double time_function_count(timeable_fn fn,unsigned int count)
+{
+	unsigned int i;
+	unsigned long long start, end;
+	timer_only_dont_print=1;
+	start=timer_start();
+	for (i=0;i<count;i++) fn();
+	end=timer_stop();
+	timer_only_dont_print=0;
+	time_last_pass=(end-start)/timer_hz;
+	return time_last_pass/count;
+}
+
+/* Fill out the statistics for these n samples.  Samples well above 
+  the median (an interrupt, or another process) are outliers, and 
+  left out of the mean and stddev.  The confidence interval is for
+  the median (the time we report), from order statistics, so it 
+  always contains the median, and outliers can't stretch it. */
+static void time_stats_compute(const double *samples,int n,struct time_stats *s)
+{
+	double sorted[time_max_samples], dev[time_max_samples];
+	int i, k=0;
+	for (i=0;i<n;i++) sorted[i]=samples[i];
+	std::sort(&sorted[0],&sorted[n]);
+	s->samples=n;
+	s->min=sorted[0];
+	s->median=sorted[n/2];
+	
+	/* Median absolute deviation: like a stddev, but outliers can't move it */
+	for (i=0;i<n;i++) dev[i]=fabs(sorted[i]-s->median);
+	std::sort(&dev[0],&dev[n]);
+	double cutoff=s->median+5*1.4826*dev[n/2];
+	if (cutoff<1.01*s->median) cutoff=1.01*s->median;
+	
+	double sum=0, sum2=0;
+	for (i=0;i<n;i++) if (sorted[i]<=cutoff) { sum+=sorted[i]; k++; }
+	s->outliers=n-k;
+	s->mean=sum/k;
+	for (i=0;i<n;i++) if (sorted[i]<=cutoff) sum2+=(sorted[i]-s->mean)*(sorted[i]-s->mean);
+	s->stddev=(k>1)?sqrt(sum2/(k-1)):0;
+	
+	/* 95% interval: 1-based ranks n/2 -+ 1.96 sqrt(n)/2 (the median's 
+	  rank is binomial), widened to the min and max for tiny n */
+	double h=0.98*sqrt((double)n);
+	int lo=(int)floor(n/2.0-h), hi=(int)ceil(n/2.0+1+h);
+	if (lo<1) lo=1;
+	if (hi>n) hi=n;
+	s->ci_low=sorted[lo-1];
+	s->ci_high=sorted[hi-1];
+}
+
+/* Longest time_function_stats keeps taking samples, in seconds */
+static double time_budget=0.5;
+
+/* Seconds left for all the timing in this run.  Runs only get a few
+  seconds (see runTime in s4g_chroot), and have to print their times
+  before they're killed, so every timing shares NETRUN_TIME_BUDGET 
+  (default 1) seconds, counted from the first timing. */
+static double time_run_left(void)
+{
+	static double start=-1, total=1.0;
+	if (start<0) {
+		const char *b=getenv("NETRUN_TIME_BUDGET");
+		if (b) total=atof(b);
+		start=time_in_seconds();
+	}
+	return total-(time_in_seconds()-start);
+}
+
 /**
-  Return the number of seconds this function takes to run.
-  May run the function several times (to average out 
-  timer granularity).
+  Time this function, and fill out statistics about its time per call.
+  Returns the median seconds per call.
 */
-double time_function(timeable_fn fn)
+double time_function_stats(timeable_fn fn,struct time_stats *s)
 {
 	static double empty_time=-1;
+	timer_setup();
 	if (empty_time<0) { /* Estimate overhead of subroutine call alone */
+		struct time_stats e;
+		timeable_fn volatile empty=timeable_fn_empty; /* (don't inline it) */
 		empty_time=0; /* To avoid infinite recursion! */
-		/* empty_time=time_function(timeable_fn_empty); */
+		time_function_stats(empty,&e);
+		empty_time=e.min;
 	}
-	enum {
+	
+	/* Warm up the caches, branch predictors, and clock rate, while
+	  finding how many calls each timing pass needs */
+	time_function_onepass(fn);
+	unsigned int count=time_last_count;
+	
+	/* Take samples until the median's 95% confidence interval is within 
+	  NETRUN_TIME_ERROR (default 1%) of it, or we run out of time */
+	double target=0.01, budget=time_budget; /* seconds */
+	if (budget>time_run_left()) budget=time_run_left();
+	const char *err=getenv("NETRUN_TIME_ERROR");
+	if (err) target=atof(err);
 #if defined(_WIN32) /* Win32 timer has coarse granularity--too slow otherwise! */
-		ntimes=1
+	int min_samples=1;
 #else
-		ntimes=3
+	int min_samples=10;
 #endif
-	};
-	double times[ntimes];
-	for (int t=0;t<ntimes;t++)
-		times[t]=time_function_onepass(fn);
-	std::sort(&times[0],&times[ntimes]);
-	return times[ntimes/2]-empty_time;
+	double samples[time_max_samples];
+	double start=time_in_seconds();
+	int n=0;
+	while (n<time_max_samples) {
+		double t=time_function_count(fn,count)-empty_time;
+		samples[n++]=(t>0)?t:0;
+		/* Out of time (or another pass won't fit), even with few samples */
+		if (time_in_seconds()-start+time_last_pass > budget) break;
+		if (n<min_samples) continue;
+		time_stats_compute(samples,n,s);
+		if (s->ci_high-s->ci_low <= 2*target*s->median) break; /* good enough */
+	}
+	time_stats_compute(samples,n,s);
+	s->overhead=empty_time;
+	s->calls=count;
+	return s->median;
+}
+
+/**
+  Return the number of seconds this function takes to run.
+  May run the function several times (to average out 
+  timer granularity).
+*/
+double time_function(timeable_fn fn)
+{
+	struct time_stats s;
+	return time_function_stats(fn,&s);
+}
+
+/* Hardware counters per call from the last print_counters (-1 if none) */
+enum {counter_cycles=0, counter_instructions, counter_cache_misses, 
+	counter_branch_misses, counter_uops, counter_max};
+static const char *counter_names[counter_max]={
+	"cycles","instructions","cache misses","branch misses","uops"
+};
+static double counter_last[counter_max]={-1,-1,-1,-1,-1};
+
+/******* Machine-readable results ***********/
+/**
+  If NETRUN_RESULTS names a file (relative to the run directory, 
+  since we're usually in a jail), each timing also appends one 
+  JSON object per line to it, like
+    {"kind":"time","name":"foo","machine":"Linux x86_64 ...","cpu":"...",
+     "timer":"tsc","flags":"g++ -O3 ...","samples":20,"median_ns":1.23,...}
+  NETRUN_CFLAGS (exported by Makefile.post) gives the compiler flags.
+*/
+#if !defined(_WIN32)
+#  include <sys/utsname.h>
+#endif
+
+/* Write ,"key":"value" with value as a JSON string */
+static void results_string(FILE *f,const char *key,const char *value)
+{
+	fprintf(f,",\"%s\":\"",key);
+	for (;*value;value++) {
+		unsigned char c=*value;
+		if (c=='"' || c=='\\') fprintf(f,"\\%c",c);
+		else if (c<0x20) fprintf(f,"\\u%04x",c);
+		else fputc(c,f);
+	}
+	fprintf(f,"\"");
+}
+
+/* Start a record of this kind, or return 0 if nobody wants records */
+static FILE *results_start(const char *kind,const char *name)
+{
+	const char *path=getenv("NETRUN_RESULTS");
+	if (path==0 || path[0]==0) return 0;
+	FILE *f=fopen(path,"a");
+	if (f==0) return 0;
+	static const char *timer_names[]={"","tsc","cntvct","monotonic_raw","gettimeofday"};
+	char machine[300], cpu[64];
+	strcpy(machine,"unknown");
+#if !defined(_WIN32)
+	struct utsname u;
+	if (0==uname(&u)) snprintf(machine,sizeof(machine),"%s %s %s",u.sysname,u.machine,u.nodename);
+#endif
+	cpu[0]=0;
+#ifdef NETRUN_TIMER_TSC
+	unsigned int b[12];
+	if (__get_cpuid(0x80000004,&b[0],&b[1],&b[2],&b[3])) { /* brand string */
+		for (int i=0;i<3;i++) 
+			__get_cpuid(0x80000002+i,&b[4*i],&b[4*i+1],&b[4*i+2],&b[4*i+3]);
+		memcpy(cpu,b,48); cpu[48]=0;
+	}
+#endif
+	const char *flags=getenv("NETRUN_CFLAGS");
+	fprintf(f,"{\"kind\":\"%s\"",kind);
+	results_string(f,"name",name);
+	results_string(f,"machine",machine);
+	results_string(f,"cpu",cpu);
+	results_string(f,"timer",timer_names[timer_kind]);
+	results_string(f,"flags",flags?flags:"");
+	return f;
+}
+
+/* Add these statistics (in ns per call) to the record */
+static void results_stats(FILE *f,const struct time_stats *s)
+{
+	fprintf(f,",\"samples\":%d,\"calls\":%u,\"outliers\":%d",s->samples,s->calls,s->outliers);
+	fprintf(f,",\"min_ns\":%.4f,\"median_ns\":%.4f,\"mean_ns\":%.4f,\"stddev_ns\":%.4f",
+		s->min*1.0e9,s->median*1.0e9,s->mean*1.0e9,s->stddev*1.0e9);
+	fprintf(f,",\"ci_low_ns\":%.4f,\"ci_high_ns\":%.4f,\"overhead_ns\":%.4f",
+		s->ci_low*1.0e9,s->ci_high*1.0e9,s->overhead*1.0e9);
+	if (timer_kind==timer_tsc) fprintf(f,",\"tsc_ticks\":%.3f",s->median*timer_hz);
+}
+
+/* Finish off the record */
+static void results_end(FILE *f)
+{
+	fprintf(f,"}\n");
+	fclose(f);
 }
 
 /**
@@ -193,12 +525,354 @@ double time_function(timeable_fn fn)
 */
 void print_time(const char *fnName,timeable_fn fn)
 {
-	double sec=time_function(fn);
+	struct time_stats s;
+	double sec=time_function_stats(fn,&s);
 	printf("%s: ",fnName);
-	if (1 || sec<1.0e-6) printf("%.2f ns/call\n",sec*1.0e9);
+	if (1 || sec<1.0e-6) {
+		printf("%.2f ns/call",sec*1.0e9);
+		if (timer_kind==timer_tsc) printf("  (%.2f ticks/call)",sec*timer_hz);
+		printf("\n");
+	}
 	else if (sec<1.0e-3) printf("%.2f us/call\n",sec*1.0e6);
 	else if (sec<1.0e0) printf("%.2f ms/call\n",sec*1.0e3);
 	else printf("%.2f s/call\n",sec);
+	printf("%s stats: min %.2f, median %.2f, 95%% CI [%.2f, %.2f], mean %.2f, stddev %.2f ns/call; "
+		"%d samples of %u calls, %d outliers, %.2f ns/call overhead subtracted\n",
+		fnName,s.min*1.0e9,s.median*1.0e9,s.ci_low*1.0e9,s.ci_high*1.0e9,
+		s.mean*1.0e9,s.stddev*1.0e9,s.samples,s.calls,s.outliers,s.overhead*1.0e9);
+#ifndef TIME_COUNTERS
+	if (getenv("NETRUN_COUNTERS"))
+#endif
+		print_counters(fnName,fn);
+	
+	FILE *f=results_start("time",fnName);
+	if (f) {
+		results_stats(f,&s);
+		if (counter_last[counter_cycles]>=0) {
+			static const char *keys[counter_max]={
+				"cycles","instructions","cache_misses","branch_misses","uops"};
+			fprintf(f,",\"counters\":{");
+			for (int c=0,n=0;c<counter_max;c++) 
+				if (counter_last[c]>=0) fprintf(f,"%s\"%s\":%.4f",(n++)?",":"",keys[c],counter_last[c]);
+			fprintf(f,"}");
+		}
+		results_end(f);
+	}
+	for (int c=0;c<counter_max;c++) counter_last[c]=-1;
+}
+
+/**
+  Hardware performance counters, via Linux perf_event_open: 
+  one group, so they all count over exactly the same calls.
+  Only user-mode events are counted, so this works with the
+  default perf_event_paranoid setting.
+*/
+#if defined(__linux__)
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Open this counter in the group (or as the leader, if group is -1).  
+   Returns its fd, or -1 if this CPU (or VM) doesn't have one. */
+static int counter_open(unsigned int type,unsigned long long config,int group) {
+	struct perf_event_attr a;
+	memset(&a,0,sizeof(a));
+	a.size=sizeof(a);
+	a.type=type;
+	a.config=config;
+	a.disabled=(group==-1); /* leader starts and stops them all */
+	a.exclude_kernel=1;
+	a.exclude_hv=1;
+	a.read_format=PERF_FORMAT_GROUP|PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open,&a,0,-1,group,0);
+}
+
+/* Raw event for micro-ops, where we know it: Intel UOPS_ISSUED.ANY,
+   or AMD (family 17h and up) retired ops.  Returns 0 if unknown. */
+static unsigned long long counter_uops_config(void) {
+#ifdef NETRUN_TIMER_TSC
+	unsigned int a,b,c,d;
+	if (!__get_cpuid(0,&a,&b,&c,&d)) return 0;
+	if (b==0x756e6547) return 0x010e; /* "GenuineIntel" */
+	if (b==0x68747541) { /* "AuthenticAMD" */
+		__get_cpuid(1,&a,&b,&c,&d);
+		if (((a>>8)&0xf)+((a>>20)&0xff)>=0x17) return 0x00c1;
+	}
+#endif
+	return 0;
+}
+
+void print_counters(const char *fnName,timeable_fn fn)
+{
+	int fd[counter_max], which[counter_max], n=0, group=-1;
+	unsigned long long config[counter_max]={
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+		counter_uops_config()
+	};
+	for (int c=0;c<counter_max;c++) {
+		if (c==counter_uops && config[c]==0) continue;
+		int f=counter_open((c==counter_uops)?PERF_TYPE_RAW:PERF_TYPE_HARDWARE,config[c],group);
+		if (f<0) {
+			if (c==counter_cycles) {
+				printf("%s counters: not available (perf_event_open: %s)\n",fnName,strerror(errno));
+				return;
+			}
+			continue; /* just skip this one */
+		}
+		if (group==-1) group=f;
+		fd[n]=f; which[n]=c; n++;
+	}
+	
+	unsigned int i,count=time_last_count;
+	if (time_last_pass>time_run_left()) { /* another pass would run us out of time */
+		for (i=0;i<(unsigned int)n;i++) close(fd[i]);
+		printf("%s counters: skipped (out of time; see NETRUN_TIME_BUDGET)\n",fnName);
+		return;
+	}
+	timer_only_dont_print=1;
+	ioctl(group,PERF_EVENT_IOC_RESET,PERF_IOC_FLAG_GROUP);
+	ioctl(group,PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+	for (i=0;i<count;i++) fn();
+	ioctl(group,PERF_EVENT_IOC_DISABLE,PERF_IOC_FLAG_GROUP);
+	timer_only_dont_print=0;
+	
+	/* nr, time_enabled, time_running, then one value per counter */
+	unsigned long long v[3+counter_max];
+	int got=read(group,v,sizeof(v));
+	for (i=0;i<(unsigned int)n;i++) close(fd[i]);
+	if (got<(int)(3+n)*8 || v[2]==0) {
+		printf("%s counters: not available (couldn't schedule counters)\n",fnName);
+		return;
+	}
+	double scale=(double)v[1]/v[2]/count; /* per call, if multiplexed */
+	double *per=counter_last;
+	for (int c=0;c<counter_max;c++) per[c]=-1;
+	for (i=0;i<(unsigned int)n;i++) per[which[i]]=v[3+i]*scale;
+	
+	printf("%s counters: ",fnName);
+	for (int c=0;c<counter_max;c++) {
+		if (per[c]<0) continue;
+		printf("%s%.2f %s",(c>0)?", ":"",per[c],counter_names[c]);
+		if (c==counter_instructions && per[counter_cycles]>0)
+			printf(", %.2f IPC",per[c]/per[counter_cycles]);
+	}
+	printf(" per call\n");
+}
+#else
+void print_counters(const char *fnName,timeable_fn fn)
+{
+	printf("%s counters: not available on this OS\n",fnName);
+}
+#endif
+
+/******* Comparing several functions ***********/
+enum {bench_max=100};
+static struct {
+	const char *name;
+	timeable_fn fn;
+} bench_list[bench_max];
+static int bench_count=0;
+
+void netrun_bench_add(const char *name,timeable_fn fn)
+{
+	for (int b=0;b<bench_count;b++) /* already have it (foo called us again) */
+		if (0==strcmp(name,bench_list[b].name)) return;
+	if (bench_count>=bench_max) {
+		printf("netrun_bench_add> Too many functions (only %d allowed)!  Ignoring %s\n",
+			bench_max,name);
+		return;
+	}
+	bench_list[bench_count].name=name;
+	bench_list[bench_count].fn=fn;
+	bench_count++;
+}
+
+void print_bench_table(void)
+{
+	if (bench_count==0) return;
+	struct time_stats s[bench_max];
+	int b, base=0;
+	const char *baseName=getenv("NETRUN_BASELINE");
+	double old_budget=time_budget;
+	for (b=0;b<bench_count;b++) { /* split the time left between them */
+		time_budget=time_run_left()/(bench_count-b);
+		if (time_budget>old_budget) time_budget=old_budget;
+		time_function_stats(bench_list[b].fn,&s[b]);
+		if (baseName && 0==strcmp(baseName,bench_list[b].name)) base=b;
+	}
+	time_budget=old_budget;
+	
+	/* Human-readable table */
+	int wide=9; /* width of the name column */
+	for (b=0;b<bench_count;b++) 
+		if ((int)strlen(bench_list[b].name)>wide) wide=strlen(bench_list[b].name);
+	printf("\n%-*s %10s  %-21s %10s %8s\n",wide,"Benchmark","ns/call","95% CI",
+		(timer_kind==timer_tsc)?"TSC ticks":"","speedup");
+	for (b=0;b<bench_count;b++) {
+		char ci[100], cyc[100];
+		snprintf(ci,sizeof(ci),"[%.2f, %.2f]",s[b].ci_low*1.0e9,s[b].ci_high*1.0e9);
+		cyc[0]=0;
+		if (timer_kind==timer_tsc) snprintf(cyc,sizeof(cyc),"%.1f",s[b].median*timer_hz);
+		printf("%-*s %10.2f  %-21s %10s %7.2fx%s\n",wide,bench_list[b].name,
+			s[b].median*1.0e9,ci,cyc,
+			(s[b].median>0)?s[base].median/s[b].median:0.0,
+			(b==base)?"  (baseline)":"");
+	}
+	
+	/* Machine-readable copies */
+	for (b=0;b<bench_count;b++) {
+		FILE *f=results_start("bench",bench_list[b].name);
+		if (f==0) break;
+		results_stats(f,&s[b]);
+		results_string(f,"baseline",bench_list[base].name);
+		fprintf(f,",\"speedup\":%.4f",(s[b].median>0)?s[base].median/s[b].median:0.0);
+		results_end(f);
+	}
+	printf("\nBenchmark CSV:\nname,ns_per_call,min_ns,ci_low_ns,ci_high_ns,tsc_ticks_per_call,speedup\n");
+	for (b=0;b<bench_count;b++)
+		printf("%s,%.3f,%.3f,%.3f,%.3f,%.2f,%.4f\n",bench_list[b].name,
+			s[b].median*1.0e9,s[b].min*1.0e9,s[b].ci_low*1.0e9,s[b].ci_high*1.0e9,
+			(timer_kind==timer_tsc)?s[b].median*timer_hz:0.0,
+			(s[b].median>0)?s[base].median/s[b].median:0.0);
+}
+
+/******* Sweeping over problem sizes ***********/
+enum {sweep_max=20};
+static struct {
+	const char *name;
+	sweepable_fn fn;
+	long max_n;
+	double bytes, flops; /* per element */
+} sweep_list[sweep_max];
+static int sweep_count=0;
+
+void netrun_sweep_add(const char *name,sweepable_fn fn,long max_n,
+	double bytes_per_element,double flops_per_element)
+{
+	if (sweep_count>=sweep_max) {
+		printf("netrun_sweep_add> Too many sweeps (only %d allowed)!  Ignoring %s\n",
+			sweep_max,name);
+		return;
+	}
+	sweep_list[sweep_count].name=name;
+	sweep_list[sweep_count].fn=fn;
+	sweep_list[sweep_count].max_n=max_n;
+	sweep_list[sweep_count].bytes=bytes_per_element;
+	sweep_list[sweep_count].flops=flops_per_element;
+	sweep_count++;
+}
+
+/* Data (or unified) cache sizes in bytes, by level 1-3, or 0 if unknown */
+static long cache_size[4];
+static void cache_setup(void)
+{
+	static int done=0;
+	if (done) return;
+	done=1;
+	for (int i=0;i<10;i++) { /* from sysfs, like "48K" */
+		char name[200], type[100], size[100];
+		int level=0;
+		snprintf(name,sizeof(name),"/sys/devices/system/cpu/cpu0/cache/index%d/level",i);
+		FILE *f=fopen(name,"r");
+		if (f==0) break;
+		if (1!=fscanf(f,"%d",&level)) level=0;
+		fclose(f);
+		snprintf(name,sizeof(name),"/sys/devices/system/cpu/cpu0/cache/index%d/type",i);
+		f=fopen(name,"r");
+		if (f==0 || 1!=fscanf(f,"%99s",type)) type[0]=0;
+		if (f) fclose(f);
+		snprintf(name,sizeof(name),"/sys/devices/system/cpu/cpu0/cache/index%d/size",i);
+		f=fopen(name,"r");
+		if (f==0 || 1!=fscanf(f,"%99s",size)) size[0]=0;
+		if (f) fclose(f);
+		if (level<1 || level>3 || 0==strcmp(type,"Instruction")) continue;
+		long bytes=atol(size);
+		if (strchr(size,'K')) bytes*=1024;
+		if (strchr(size,'M')) bytes*=1024*1024;
+		cache_size[level]=bytes;
+	}
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+	/* No sysfs (like in the jail): ask the C library, which asks cpuid */
+	if (cache_size[1]<=0) cache_size[1]=sysconf(_SC_LEVEL1_DCACHE_SIZE);
+	if (cache_size[2]<=0) cache_size[2]=sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if (cache_size[3]<=0) cache_size[3]=sysconf(_SC_LEVEL3_CACHE_SIZE);
+#endif
+}
+
+/* Print a byte count like "48 KB" */
+static const char *print_bytes(double bytes,char *buf)
+{
+	if (bytes<1024) sprintf(buf,"%.0f B",bytes);
+	else if (bytes<1024*1024) sprintf(buf,"%.3g KB",bytes/1024);
+	else if (bytes<1024*1024*1024) sprintf(buf,"%.3g MB",bytes/(1024*1024));
+	else sprintf(buf,"%.3g GB",bytes/(1024*1024*1024));
+	return buf;
+}
+
+/* The sweep function and size being timed right now */
+static sweepable_fn sweep_fn;
+static long sweep_n;
+static int sweep_call(void) { return sweep_fn(sweep_n); }
+
+void print_sweeps(void)
+{
+	if (sweep_count==0) return;
+	cache_setup();
+	double old_budget=time_budget;
+	time_budget=0.05; /* a sweep is many timings, and runs get only a few seconds */
+	for (int w=0;w<sweep_count;w++) {
+		char buf[100];
+		double bytes=sweep_list[w].bytes, flops=sweep_list[w].flops;
+		printf("\nSweep %s: %g bytes and %g flops per element (%.3f flops/byte)\n",
+			sweep_list[w].name,bytes,flops,(bytes>0)?flops/bytes:0.0);
+		printf("%10s %12s %12s %12s %10s %10s\n",
+			"n","working set","ns/call","ns/element","GB/s","GFLOP/s");
+		
+		int level=1; /* next cache level to cross */
+		double csv[64][3]; /* n, seconds, level */
+		int nRows=0;
+		sweep_fn=sweep_list[w].fn;
+		for (long n=16;nRows<64;n*=2) {
+			if (n>sweep_list[w].max_n) n=sweep_list[w].max_n;
+			double set=n*bytes;
+			while (level<=3 && (cache_size[level]<=0 || set>cache_size[level])) {
+				if (cache_size[level]>0)
+					printf("  ---- past L%d (%s) ----\n",level,print_bytes(cache_size[level],buf));
+				level++;
+			}
+			struct time_stats s;
+			sweep_n=n;
+			double sec=time_function_stats(sweep_call,&s);
+			printf("%10ld %12s %12.2f %12.4f %10.2f %10.2f\n",n,print_bytes(set,buf),
+				sec*1.0e9,sec*1.0e9/n,(sec>0)?set/sec*1.0e-9:0.0,(sec>0)?n*flops/sec*1.0e-9:0.0);
+			FILE *f=results_start("sweep",sweep_list[w].name);
+			if (f) {
+				static const char *fits[5]={"","L1","L2","L3","DRAM"};
+				results_stats(f,&s);
+				fprintf(f,",\"n\":%ld,\"bytes\":%.0f,\"gb_per_s\":%.4f,\"gflop_per_s\":%.4f,\"flops_per_byte\":%.4f",
+					n,set,(sec>0)?set/sec*1.0e-9:0.0,(sec>0)?n*flops/sec*1.0e-9:0.0,(bytes>0)?flops/bytes:0.0);
+				results_string(f,"fits_in",fits[level]);
+				results_end(f);
+			}
+			csv[nRows][0]=n; csv[nRows][1]=sec; csv[nRows][2]=level;
+			nRows++;
+			if (n>=sweep_list[w].max_n) break;
+		}
+		
+		printf("\nSweep CSV:\nname,n,bytes,ns_per_call,gb_per_s,gflop_per_s,flops_per_byte,fits_in\n");
+		for (int r=0;r<nRows;r++) {
+			double n=csv[r][0], sec=csv[r][1];
+			static const char *fits[5]={"","L1","L2","L3","DRAM"};
+			printf("%s,%.0f,%.0f,%.3f,%.4f,%.4f,%.4f,%s\n",sweep_list[w].name,
+				n,n*bytes,sec*1.0e9,(sec>0)?n*bytes/sec*1.0e-9:0.0,
+				(sec>0)?n*flops/sec*1.0e-9:0.0,(bytes>0)?flops/bytes:0.0,
+				fits[(int)csv[r][2]]);
+		}
+	}
+	time_budget=old_budget;
 }
 
 /********* Checksums ***************/
@@ -403,10 +1077,8 @@ struct machine_state {
 #endif
 };
 
-#ifdef __cplusplus
-extern "C" 
-#endif
-void TraceASM_cside(long line,const char *code,struct machine_state *state,long state_bytes,
+/* Print the changes in machine state after this line of code */
+static void TraceASM_print(long line,const char *code,const struct machine_state *state,
 	const char *code_next)
 {
 #ifdef __AARCH64EL__
@@ -436,14 +1108,6 @@ void TraceASM_cside(long line,const char *code,struct machine_state *state,long
 	int nprinted=0;
 	char flags[10];
 
-	if (timer_only_dont_print) return;
-	
-	if (state_bytes!=sizeof(struct machine_state)) {
-		printf("Error: machine state size mismatch, got %ld expected %ld",
-			(long)state_bytes,(long)sizeof(struct machine_state));
-		return;
-	}
-	
 	if (code_next_last != NULL && 0!=strcmp(code_next_last,code)) {
 		// Jumped out from last call
 		printf("TraceASM      %-30s -> jumped out\n", code_next_last);
@@ -546,3 +1210,108 @@ void TraceASM_cside(long line,const char *code,struct machine_state *state,long
 }
 
 
+/**
+ Buffered TraceASM: instead of printing every traced instruction as
+ it runs, which is thousands of times slower than the instruction, 
+ just copy the machine state into a ring buffer, and print the diffs 
+ at exit.  Turn this on by compiling with TRACEASM_BUFFER (the 
+ FastTrace checkbox) or setting NETRUN_TRACE_BUFFER to the number
+ of records to keep (default 10000); past that, only the last 
+ records are kept.  Since the sandbox kills programs that run too 
+ long, a traced program stops itself after NETRUN_TRACE_SECONDS 
+ (default 1.5) and prints what it has.
+*/
+struct TraceASM_record {
+	long line;
+	const char *code, *code_next; /* (static strings in the user's code) */
+	struct machine_state state;
+};
+static struct TraceASM_record *trace_buffer=0;
+static long trace_max=0; /* records in trace_buffer (0 if not buffering) */
+static long trace_count=0; /* records ever added */
+static double trace_seconds=1.5; /* time before we stop the program */
+static volatile int trace_time_up=0;
+
+/* Print out all the buffered records, oldest first */
+static void TraceASM_flush(void)
+{
+	long i, first=0;
+	if (trace_buffer==0) return;
+	if (trace_count>trace_max) {
+		first=trace_count-trace_max;
+		printf("TraceASM: skipping the first %ld records (only the last %ld are kept)\n",
+			first,trace_max);
+	}
+	for (i=first;i<trace_count;i++) {
+		const struct TraceASM_record *r=&trace_buffer[i%trace_max];
+		TraceASM_print(r->line,r->code,&r->state,r->code_next);
+	}
+	trace_count=0;
+}
+
+#if !defined(_WIN32)
+#include <signal.h>
+#include <sys/time.h>
+static void TraceASM_alarm(int sig) { trace_time_up=1; }
+#endif
+
+/* Decide if we're buffering, and set up the buffer */
+static void TraceASM_setup(void)
+{
+	static int done=0;
+	if (done) return;
+	done=1;
+	const char *max=getenv("NETRUN_TRACE_BUFFER");
+#ifndef TRACEASM_BUFFER
+	if (max==0) return; /* print as we go */
+#endif
+	trace_max=10000;
+	if (max && atol(max)>0) trace_max=atol(max);
+	trace_buffer=(struct TraceASM_record *)malloc(trace_max*sizeof(struct TraceASM_record));
+	if (trace_buffer==0) { trace_max=0; return; }
+	atexit(TraceASM_flush);
+#if !defined(_WIN32)
+	const char *secs=getenv("NETRUN_TRACE_SECONDS");
+	if (secs && atof(secs)>0) trace_seconds=atof(secs);
+	struct itimerval t;
+	t.it_interval.tv_sec=t.it_interval.tv_usec=0;
+	t.it_value.tv_sec=(long)trace_seconds;
+	t.it_value.tv_usec=(long)((trace_seconds-(long)trace_seconds)*1.0e6);
+	signal(SIGALRM,TraceASM_alarm);
+	setitimer(ITIMER_REAL,&t,0);
+#endif
+}
+
+/* Called by the TraceASM macro after each traced line of code */
+#ifdef __cplusplus
+extern "C" 
+#endif
+void TraceASM_cside(long line,const char *code,struct machine_state *state,long state_bytes,
+	const char *code_next)
+{
+	if (timer_only_dont_print) return;
+	
+	if (state_bytes!=sizeof(struct machine_state)) {
+		printf("Error: machine state size mismatch, got %ld expected %ld",
+			(long)state_bytes,(long)sizeof(struct machine_state));
+		return;
+	}
+	
+	TraceASM_setup();
+	if (trace_max==0) { /* not buffering */
+		TraceASM_print(line,code,state,code_next);
+		return;
+	}
+	
+	struct TraceASM_record *r=&trace_buffer[trace_count%trace_max];
+	r->line=line;
+	r->code=code;
+	r->code_next=code_next;
+	memcpy(&r->state,state,sizeof(struct machine_state));
+	trace_count++;
+	
+	if (trace_time_up) { /* out of time: show the trace before we're killed */
+		printf("TraceASM: stopping the program after %.1f seconds\n",trace_seconds);
+		exit(1); /* (prints the trace) */
+	}
+}
@@ -131,6 +131,19 @@ typedef int (*timeable_fn)(void);
 */
 CDECL double time_in_seconds(void);
 
+/**
+  Return the current time in ticks of the fine-grained timer 
+  time_function uses: the x86 time stamp counter, the AArch64 
+  virtual counter, or else CLOCK_MONOTONIC_RAW nanoseconds.
+  (NETRUN_TIMER=gettimeofday in the environment turns this off.)
+*/
+CDECL unsigned long long time_in_ticks(void);
+
+/**
+  Return the number of those ticks per second (calibrated at startup).
+*/
+CDECL double ticks_per_second(void);
+
 /**
   Return the number of seconds this function takes to run.
   May run the function several times (to average out 
@@ -139,10 +152,101 @@ CDECL double time_in_seconds(void);
 CDECL double time_function(timeable_fn fn);
 
 /**
-  Time a function's execution, and print this time out.
+  Statistics about a function's time per call, in seconds.
+*/
+enum {time_max_samples=200};
+struct time_stats {
+	double min, median, mean, stddev;
+	double ci_low, ci_high; /* 95% confidence interval for the median */
+	double overhead; /* empty-call overhead, already subtracted */
+	int samples; /* timing passes */
+	int outliers; /* slow passes left out of the mean */
+	unsigned int calls; /* calls per pass */
+};
+
+/**
+  Warm up, then time this function until the median's 95% confidence
+  interval is within NETRUN_TIME_ERROR (default 0.01, or 1%) of it, 
+  or half a second passes.  All the timings in a run share 
+  NETRUN_TIME_BUDGET (default 1) seconds, so a slow function may get
+  only a few samples.  Fills out s, and returns the median.
+*/
+CDECL double time_function_stats(timeable_fn fn,struct time_stats *s);
+
+/**
+  Time a function's execution, and print this time out, like
+    foo: 1.23 ns/call  (3.69 ticks/call)
+    foo stats: min 1.22, median 1.23, 95% CI [1.22, 1.25], mean 1.24, ...
+  The ticks are time stamp counter ticks (x86 only), which run at a
+  fixed rate, not core clock cycles; print_counters counts real cycles.
 */
 CDECL void print_time(const char *fnName,timeable_fn fn);
 
+/**
+  Count a function's cycles, instructions, cache misses, branch misses, 
+  and micro-ops (where the CPU has them) per call, and print them like
+    foo counters: 3.70 cycles, 9.00 instructions, 2.43 IPC, ... per call
+  print_time does this too if compiled with TIME_COUNTERS, or 
+  if NETRUN_COUNTERS is set in the environment.  Linux only.
+*/
+CDECL void print_counters(const char *fnName,timeable_fn fn);
+
+/**
+  Register a function to be timed against the others, like
+    NETRUN_BENCH(scalar,add_scalar)
+    NETRUN_BENCH(sse,add_sse)
+  With the Time checkbox (TIME_FOO), main prints a table of each
+  one's time and speedup over the first one (or the one named in 
+  NETRUN_BASELINE), then the same table as CSV.
+  From assembly or Fortran, call netrun_bench_add from foo: main times
+  foo (thousands of calls) before the table, and adding a name that's
+  already registered does nothing.
+  (The macro's variable is netrun_bench_registered_<name>, so a name
+  like "add" can't collide with netrun_bench_add itself.)
+*/
+CDECL void netrun_bench_add(const char *name,timeable_fn fn);
+#ifdef __cplusplus
+#  define NETRUN_BENCH(name,fn) \
+	static int netrun_bench_registered_##name=(netrun_bench_add(#name,(timeable_fn)(fn)),0);
+#else
+#  define NETRUN_BENCH(name,fn) \
+	__attribute__((constructor)) static void netrun_bench_registered_##name(void) \
+		{ netrun_bench_add(#name,(timeable_fn)(fn)); }
+#endif
+
+/**
+  Time every registered function, and print the table.  
+  Does nothing if none were registered.
+*/
+CDECL void print_bench_table(void);
+
+/**
+  Register a function to be timed over problem sizes n=16, 32, 64, ...
+  up to max_n, like
+    int add_arrays(long n) { for (long i=0;i<n;i++) a[i]+=b[i]; return 0; }
+    NETRUN_SWEEP(add,add_arrays,1024*1024, 12,1)
+  where each element touches 12 bytes (two float loads and a store) and
+  does 1 flop.  With the Time checkbox, main prints the GB/s and GFLOP/s
+  at each size, marks where the working set (n times the bytes) outgrows
+  the L1, L2, and L3 caches, and then prints the same table as CSV.
+*/
+typedef int (*sweepable_fn)(long n);
+CDECL void netrun_sweep_add(const char *name,sweepable_fn fn,long max_n,
+	double bytes_per_element,double flops_per_element);
+#ifdef __cplusplus
+#  define NETRUN_SWEEP(name,fn,max_n,bytes,flops) \
+	static int netrun_sweep_registered_##name=(netrun_sweep_add(#name,(sweepable_fn)(fn),max_n,bytes,flops),0);
+#else
+#  define NETRUN_SWEEP(name,fn,max_n,bytes,flops) \
+	__attribute__((constructor)) static void netrun_sweep_registered_##name(void) \
+		{ netrun_sweep_add(#name,(sweepable_fn)(fn),max_n,bytes,flops); }
+#endif
+
+/**
+  Time every registered sweep, and print the tables.
+*/
+CDECL void print_sweeps(void);
+
 /********* Checksums ***************/
 CDECL int iarray_print(int *arr,int n);
 CDECL long larray_print(long *arr,long n);
@@ -86,6 +86,8 @@ int main() {
 #ifdef TIME_FOO /* Timing mode */
 	printf("Timing foo...\n");
 	print_time("foo",(timeable_fn)foo);
+	print_bench_table(); /* and anything registered with NETRUN_BENCH */
+	print_sweeps(); /* or NETRUN_SWEEP */
 #endif
 
 /* Normal case */
@@ -104,7 +104,7 @@ time_sub="foo";
 grade_perf() {
 	t="$1"
 	a="$2"
-	echo "$in" | $prog > $0.out
+	echo "$in" | S4G_BENCH=1 $prog > $0.out # time it on a reserved core
 	grep -v $time_sub $0.out > $0.out.strip
 	ans=`cat $0.out.strip`
 	if [ "$ans" != "$a" ]
@@ -121,7 +121,13 @@ grade_perf() {
 		exit 1
 	fi
 	tperf=`grep "$time_sub:" $0.out | awk '{print $2}'`
-	perf=`grep "$time_sub:" $0.out | awk '{if ($2>'$t') print("slow");  else { if (!done) { print("fast"); done=1;} } }'`
+	# Only call it slow if the median's whole 95% confidence interval is over $t
+	tlow=`sed -n 's/^'$time_sub' stats:.*95% CI \[\([0-9.]*\),.*/\1/p' $0.out | head -1`
+	if [ -z "$tlow" ]
+	then
+		tlow=`echo "$tperf" | head -1`
+	fi
+	perf=`echo "$tlow" | awk '{if ($1>'$t') print("slow");  else print("fast"); }'`
 	if [ ! "$perf" = "fast" ]
 	then
 		echo "Sorry, $time_sub is still too slow-- $time_sub should run in $t ns/call or less; but it actually ran in $tperf ns/call.<br>"
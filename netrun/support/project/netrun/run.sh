@@ -13,10 +13,18 @@ shift; shift
 #echo "$desc: $@ <br>"
 
 # Run command, capturing stdout and stderr to "out" file.
+[ -n "$NETRUN_TIMING" ] && start=`date +%s%N`
 "$@" > out 2>&1
 
 res=$?
 
+# If sandserv wants timings, add this phase's (in microseconds)
+if [ -n "$NETRUN_TIMING" ]
+then
+	end=`date +%s%N`
+	echo "phase "`echo "$desc" | tr A-Z a-z`" "$(( (end-start)/1000 )) >> "$NETRUN_TIMING"
+fi
+
 # If there's anything in the file, show output of command
 if [ -s out ]
 then
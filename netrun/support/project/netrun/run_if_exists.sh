@@ -1,7 +1,13 @@
 #!/bin/sh
 if [ -x "$1" ]
 then
+	[ -n "$NETRUN_TIMING" ] && start=`date +%s%N`
 	"$@"
+	if [ -n "$NETRUN_TIMING" ]
+	then
+		end=`date +%s%N`
+		echo "phase "`basename "$1" .sh`" "$(( (end-start)/1000 )) >> "$NETRUN_TIMING"
+	fi
 fi
 exit 0
 